@@ -16,6 +16,7 @@
 */
 
 #include "crc32c.h"
+#include "pool.h"
 
 static const uint32_t crc32c_table[256] = {
   0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L,
@@ -101,29 +102,119 @@ typedef u32 (*crc32c_func)(u32, u8 *, sz);
   extern EXTERNAL_ABI int xpar_x86_64_cpuflags(void);
   extern EXTERNAL_ABI u32 crc32c_small_x86_64_sse42(u32, u8 *, sz);
   extern EXTERNAL_ABI u32 crc32c_32k_x86_64_sse42(u32, u8 *, sz);
+  extern EXTERNAL_ABI u32 crc32c_fold_x86_64_avx512(u32, u8 *, sz);
+  extern EXTERNAL_ABI u32 crc32c_fold_x86_64_avx2(u32, u8 *, sz);
+
+  // Below this, the folding kernels barely get past their set-up.
+  #define CRC32C_FOLD_MIN 1024
 #elif defined(XPAR_AARCH64)
   extern int crc32c_aarch64_cpuflags(void);
   extern u32 crc32c_small_aarch64_neon(u32, u8 *, sz);
+  extern u32 crc32c_3way_aarch64_pmull(u32, u8 *, sz);
+
+  // One block of the 3-way kernel.
+  #define CRC32C_3WAY_MIN (3 * 4096 + 8)
 #endif
 
-u32 crc32c(u8 * data, sz length) {
+static u32 crc32c_serial(u32 crc, u8 * data, sz length) {
   static int cpuflags = -1;
+  crc ^= 0xFFFFFFFFL;
 #if defined(XPAR_X86_64)
   if (cpuflags == -1) cpuflags = xpar_x86_64_cpuflags();
   if (cpuflags & 1) {
-    if (length >= 32767)
-      return crc32c_32k_x86_64_sse42(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+    if (length >= CRC32C_FOLD_MIN && (cpuflags & 0x14) == 0x14)
+      return crc32c_fold_x86_64_avx512(crc, data, length) ^ 0xFFFFFFFFL;
+    else if (length >= CRC32C_FOLD_MIN && (cpuflags & 0x30) == 0x30)
+      return crc32c_fold_x86_64_avx2(crc, data, length) ^ 0xFFFFFFFFL;
+    else if (length >= 32767)
+      return crc32c_32k_x86_64_sse42(crc, data, length) ^ 0xFFFFFFFFL;
     else
-      return crc32c_small_x86_64_sse42(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+      return crc32c_small_x86_64_sse42(crc, data, length) ^ 0xFFFFFFFFL;
   } else
-    return crc32c_tabular(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+    return crc32c_tabular(crc, data, length) ^ 0xFFFFFFFFL;
 #elif defined(XPAR_AARCH64)
   if (cpuflags == -1) cpuflags = crc32c_aarch64_cpuflags();
-  if (cpuflags)
-    return crc32c_small_aarch64_neon(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+  // Bit 7 is CRC32 support, bit 4 PMULL support.
+  if ((cpuflags & 0x90) == 0x90 && length >= CRC32C_3WAY_MIN)
+    return crc32c_3way_aarch64_pmull(crc, data, length) ^ 0xFFFFFFFFL;
+  else if (cpuflags & 0x80)
+    return crc32c_small_aarch64_neon(crc, data, length) ^ 0xFFFFFFFFL;
   else
-    return crc32c_tabular(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+    return crc32c_tabular(crc, data, length) ^ 0xFFFFFFFFL;
 #else
-  return crc32c_tabular(0xFFFFFFFFL, data, length) ^ 0xFFFFFFFFL;
+  return crc32c_tabular(crc, data, length) ^ 0xFFFFFFFFL;
 #endif
 }
+
+// ============================================================================
+//  Combining CRCs. Appending n bytes to a message multiplies the CRC register
+//  by x^(8n) modulo the polynomial before the CRC of the bytes themselves is
+//  added, so the CRCs of the parts of a buffer can be computed separately and
+//  merged. In the bit-reflected representation used here, x^0 is the most
+//  significant bit.
+// ============================================================================
+static u32 multmodp(u32 a, u32 b) {
+  u32 p = 0;
+  for (u32 m = 1U << 31; m; m >>= 1) {
+    if (a & m) p ^= b;
+    b = b & 1 ? (b >> 1) ^ 0x82F63B78L : b >> 1;
+  }
+  return p;
+}
+// x^(8n) mod P, by squaring.
+static u32 xpow8n(u64 n) {
+  u32 p = 1U << 31, sq = 1U << 23;
+  for (; n; n >>= 1, sq = multmodp(sq, sq))
+    if (n & 1) p = multmodp(sq, p);
+  return p;
+}
+u32 crc32c_combine(u32 crc1, u32 crc2, u64 len2) {
+  return multmodp(xpow8n(len2), crc1) ^ crc2;
+}
+
+// Large buffers are cut into at most CRC32C_PARTS parts of equal size (but
+// for the last one), checksummed on the thread pool and combined in order.
+#define CRC32C_PARALLEL_MIN (4 << 20)
+#define CRC32C_PART_MIN (1 << 20)
+#define CRC32C_PARTS 256
+typedef struct { u8 * data; sz length, part; u32 crc[CRC32C_PARTS]; } crc_job_t;
+static void crc_range(void * ctx, sz lo, sz hi) {
+  crc_job_t * j = ctx;
+  for (sz i = lo; i < hi; i++)
+    j->crc[i] = crc32c_serial(0, j->data + i * j->part,
+                              MIN(j->part, j->length - i * j->part));
+}
+static u32 crc32c_parallel(u32 crc, u8 * data, sz length) {
+  crc_job_t j = { .data = data, .length = length,
+                  .part = (length + CRC32C_PARTS - 1) / CRC32C_PARTS };
+  if (j.part < CRC32C_PART_MIN) j.part = CRC32C_PART_MIN;
+  sz parts = (length + j.part - 1) / j.part, last = length - (parts - 1) * j.part;
+  pool_for(parts, 1, crc_range, &j);
+  u32 shift = xpow8n(j.part);
+  crc = crc32c_combine(crc, j.crc[0], j.part);
+  Fi0(parts - 1, 1, crc = multmodp(shift, crc) ^ j.crc[i]);
+  return crc32c_combine(crc, j.crc[parts - 1], last);
+}
+
+// Continues a CRC computed by `crc32c' (or started at 0) over more data,
+// so that crc32c_update(crc32c(a), b) == crc32c(a || b).
+u32 crc32c_update(u32 crc, u8 * data, sz length) {
+  if (length >= CRC32C_PARALLEL_MIN && pool_threads() > 1)
+    return crc32c_parallel(crc, data, length);
+  return crc32c_serial(crc, data, length);
+}
+
+// The copy is checksummed a block at a time while it is still in the cache,
+// so that the data is only read from memory once.
+#define CRC32C_COPY_BLOCK 4096
+u32 crc32c_copy(u32 crc, u8 * dst, u8 * src, sz length) {
+  for (sz k; length; length -= k, dst += k, src += k) {
+    k = MIN(length, CRC32C_COPY_BLOCK);  memcpy(dst, src, k);
+    crc = crc32c_serial(crc, dst, k);
+  }
+  return crc;
+}
+
+u32 crc32c(u8 * data, sz length) {
+  return crc32c_update(0, data, length);
+}
@@ -21,5 +21,10 @@
 #include "common.h"
 
 u32 crc32c(u8 * data, sz length);
+u32 crc32c_update(u32 crc, u8 * data, sz length);
+// Copies `length' bytes from `src' to `dst' and continues `crc' over them.
+u32 crc32c_copy(u32 crc, u8 * dst, u8 * src, sz length);
+// The CRC of a || b, given the CRCs of a and b and the length of b.
+u32 crc32c_combine(u32 crc1, u32 crc2, u64 len2);
 
 #endif
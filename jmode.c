@@ -18,13 +18,13 @@
 #include "jmode.h"
 #include "crc32c.h"
 #include "platform.h"
-
-#if defined(XPAR_OPENMP)
-  #include <omp.h>
-#endif
+#include "pool.h"
+#include "xpar.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
 
 // ============================================================================
 //  Reed-Solomon code parameters (223 bytes of input, 32 bytes of parity).
@@ -40,6 +40,11 @@
 // ============================================================================
 static u8 LOG[256], EXP[256], PROD[256][256], DP[256][256];
 u8 PROD_GEN[256][32];
+static u8 gf256_div(u8 a, u8 b) {
+  if (!a || !b) return 0;
+  int d = LOG[a] - LOG[b];
+  return EXP[d < 0 ? d + 255 : d];
+}
 void jmode_gf256_gentab(u8 poly) {
   for (int l = 0, b = 1; l < 255; l++) {
     LOG[b] = l;  EXP[l] = b;
@@ -59,11 +64,6 @@ void jmode_gf256_gentab(u8 poly) {
     for (int j = 0; j < T; j++)
       PROD_GEN[i][j] = PROD[i][gen[j]];
 }
-static u8 gf256_div(u8 a, u8 b) {
-  if (!a || !b) return 0;
-  int d = LOG[a] - LOG[b];
-  return EXP[d < 0 ? d + 255 : d];
-}
 #if defined(XPAR_X86_64)
 #ifdef HAVE_FUNC_ATTRIBUTE_SYSV_ABI
   #define EXTERNAL_ABI __attribute__((sysv_abi))
@@ -168,6 +168,41 @@ int rsd32(u8 data[N]) {
   return count;
 }
 
+// The code is linear, so the difference between the parity of a word and the
+// parity computed from its data is a linear map (zero exactly on codewords).
+// Its columns for the data positions are the parities of the unit vectors;
+// the columns for the parity positions are unit vectors.
+static u8 PCHECK[K][T];
+static void rs_pcheck_gentab(void) {
+  u8 d[K] = { 0 }, c[N];
+  Fi(K, d[i] = 1; rse32(d, c); memcpy(PCHECK[i], c + K, T); d[i] = 0)
+}
+// Solves for the `m' erased positions `e' of a word. Returns false unless the
+// erasures determine a unique codeword consistent with the other symbols.
+static bool rs_erasures(u8 c[N], int * e, int m) {
+  u8 a[T][T + 1], cw[N];  int rank = 0;
+  if (m > T) return false;
+  rse32(c, cw);
+  Fi(T, Fj(m, a[i][j] = e[j] < K ? PCHECK[e[j]][i] : e[j] - K == i)
+        a[i][T] = cw[K + i] ^ c[K + i])
+  for (int col = 0; col < m; col++) {
+    int piv = rank;
+    while (piv < T && !a[piv][col]) piv++;
+    if (piv == T) return false;
+    Fj(T + 1, u8 x = a[piv][j]; a[piv][j] = a[rank][j]; a[rank][j] = x)
+    u8 p = a[rank][col];
+    Fj(T + 1, a[rank][j] = gf256_div(a[rank][j], p))
+    Fi(T, if (i != rank && a[i][col]) {
+      u8 f = a[i][col];
+      Fj(T + 1, a[i][j] ^= PROD[f][a[rank][j]])
+    })
+    rank++;
+  }
+  Fi0(T, rank, if (a[i][T]) return false)
+  Fi(m, c[e[i]] ^= a[i][T])
+  return true;
+}
+
 // ============================================================================
 //  Processing. We apply a few strategies that depend on some specifics of the
 //  process at hand:
@@ -186,11 +221,16 @@ static int compute_interlacing_bs(int ifactor) {
 static void trans2D(u8 * restrict in, u8 * restrict out) {
   Fi(N, Fj(N, out[j * N + i] = in[i * N + j]))
 }
+typedef struct { u8 * in, * out; } trans_t;
+static void trans3D_range(void * ctx, sz lo, sz hi) {
+  trans_t * t = ctx;
+  for (sz i = lo; i < hi; i++)
+    Fj(N, Fk(N, t->out[k * N * N + j * N + i] = t->in[i * N * N + j * N + k]))
+}
+// Split like the codeword loops below, by slabs of the input.
 static void trans3D(u8 * restrict in, u8 * restrict out) {
-#if defined(XPAR_OPENMP)
-  #pragma omp parallel for
-#endif
-  Fi(N, Fj(N, Fk(N, out[k * N * N + j * N + i] = in[i * N * N + j * N + k])))
+  trans_t t = { in, out };
+  pool_static(N, trans3D_range, &t);
 }
 static void do_interlacing(u8 * restrict in, u8 * restrict out, int ifactor) {
   switch (ifactor) {
@@ -199,11 +239,98 @@ static void do_interlacing(u8 * restrict in, u8 * restrict out, int ifactor) {
     case 3: trans3D(in, out); break;
   }
 }
-static void write_header(FILE * des, int ifactor) {
+
+// ============================================================================
+//  Codeword loops. The codewords of a lace are independent, and with the
+//  largest interlacing factor they are spread between the threads. Smaller
+//  laces are left to a single thread, as laces are processed in parallel
+//  instead wherever possible. The largest laces come from the lace arena,
+//  whose pages are first touched by the pool threads in a static partition,
+//  and are split between the threads in the same way.
+// ============================================================================
+static void lace_for(sz n, int ifactor, pool_fn fn, void * ctx) {
+  if (ifactor == 3) pool_static(n, fn, ctx); else pool_for(n, n, fn, ctx);
+}
+// The data of a lace is checksummed codeword by codeword as it is encoded or
+// decoded, while it is still in the cache. The CRC of the part of the data
+// in a range is shifted over the data after it, so that the CRCs of all the
+// ranges can be combined with a xor, in any order.
+static sz cw_bytes(sz i, sz bytes) {
+  return i * K < bytes ? MIN(K, bytes - i * K) : 0;
+}
+static void crc_part(u32 * acc, u32 crc, sz bytes, sz hi) {
+  if (!crc) return;
+  crc = crc32c_combine(crc, 0, bytes - MIN(bytes, hi * K));
+  pool_lock();  *acc ^= crc;  pool_unlock();
+}
+typedef struct {
+  u8 * in, * out;
+  sz bytes;  u32 crc; // The CRC of the first `bytes' bytes of `in'.
+} rse_job_t;
+static void rse_range(void * ctx, sz lo, sz hi) {
+  rse_job_t * j = ctx;  u32 crc = 0;
+  for (sz i = lo; i < hi; i++) {
+    rse32(j->in + i * K, j->out + i * N);
+    crc = crc32c_update(crc, j->in + i * K, cw_bytes(i, j->bytes));
+  }
+  crc_part(&j->crc, crc, j->bytes, hi);
+}
+// Encodes the consecutive data parts in `in' into codewords in `out'.
+// Returns the CRC of the first `bytes' bytes of `in'.
+static u32 rse_lace(u8 * in, u8 * out, sz bytes, int ifactor) {
+  rse_job_t j = { in, out, bytes, 0 };
+  lace_for(compute_interlacing_bs(ifactor), ifactor, rse_range, &j);
+  return j.crc;
+}
+typedef struct {
+  u8 * cw, * out;  // The data parts are copied to `out', if given.
+  bool verify;     // Re-encode corrected codewords to catch miscorrections.
+  bool report, quiet, force;  unsigned lace;  sz ibs;
+  sz bytes;  u32 crc; // The CRC of the first `bytes' bytes of data.
+  int ecc, lost;
+} rsd_job_t;
+static void rsd_range(void * ctx, sz lo, sz hi) {
+  rsd_job_t * j = ctx;  int ecc = 0, lost = 0;  u32 crc = 0;
+  for (sz i = lo; i < hi; i++) {
+    u8 * c = j->cw + i * N;  int n = rsd32(c);
+    if (n > 0 && j->verify) {
+      u8 e[N];  rse32(c, e);
+      if (memcmp(e + K, c + K, N - K)) n = -1;
+    }
+    if (n >= 0) ecc += n;
+    else if (lost++, j->report) {
+      // POSIX requires single I/O function calls to be thread-safe.
+      const unsigned lace_ibs = j->lace * j->ibs + i;
+      if (!j->quiet)
+        fprintf(stderr,
+          "Block %u (lace %u, bytes %u-%u) irrecoverable.\n",
+          lace_ibs, j->lace, lace_ibs * N, lace_ibs * N + N - 1);
+      if (!j->force) exit(1);
+    }
+    sz m = cw_bytes(i, j->bytes);
+    if (j->out) {
+      crc = crc32c_copy(crc, j->out + i * K, c, m);
+      memcpy(j->out + i * K + m, c + m, K - m);
+    } else crc = crc32c_update(crc, c, m);
+  }
+  pool_add(&j->ecc, ecc);  pool_add(&j->lost, lost);
+  crc_part(&j->crc, crc, j->bytes, hi);
+}
+// Decodes the de-interlaced codewords in `j->cw', counting the corrected
+// errors and the codewords that could not be decoded.
+static void rsd_lace(rsd_job_t * j, int ifactor) {
+  j->ibs = compute_interlacing_bs(ifactor);  j->ecc = j->lost = 0;  j->crc = 0;
+  lace_for(j->ibs, ifactor, rsd_range, j);
+}
+#define HEADER_SIZE (5 + N - K)
+static void pack_header(u8 b[HEADER_SIZE], u8 tag, int ifactor) {
   u8 h[K] = { 0 }, out[N];
-  h[0] = 'X'; h[1] = 'P'; h[2] = XPAR_MAJOR; h[3] = XPAR_MINOR;
+  h[0] = 'X'; h[1] = tag; h[2] = XPAR_MAJOR; h[3] = XPAR_MINOR;
   h[4] = ifactor + '0';
-  rse32(h, out); xfwrite(h, 5, des); xfwrite(out + K, N - K, des);
+  rse32(h, out); memcpy(b, h, 5); memcpy(b + 5, out + K, N - K);
+}
+static void write_header(FILE * des, u8 tag, int ifactor) {
+  u8 b[HEADER_SIZE];  pack_header(b, tag, ifactor);  xfwrite(b, HEADER_SIZE, des);
 }
 static int parse_header(u8 out[N], int force, int ifactor_override) {
   if (out[0] != 'X' || out[1] != 'P')
@@ -224,20 +351,22 @@ static int read_header(FILE * des, int force, int ifactor_override) {
 }
 #ifdef XPAR_ALLOW_MAPPING
 static int read_header_from_map(mmap_t map, int force, int ifactor_override) {
-  if (map.size < 5 + N - K)
+  if (map.size < HEADER_SIZE)
     FATAL("Truncated file.");
   u8 out[N]; memcpy(out, map.map, 5); memcpy(out + K, map.map + 5, N - K);
   return parse_header(out, force, ifactor_override);
 }
 #endif
 typedef struct { u32 bytes, crc; } block_hdr;
-static void write_block_header(FILE * des, block_hdr h) {
-  u8 b[8]; b[0] = 'X';
+static void pack_block_header(u8 b[8], block_hdr h) {
+  b[0] = 'X';
   if (h.bytes > 0xFFFFFF)
     FATAL("Could not write the header: block too big.");
   b[1] = h.bytes >> 16; b[2] = h.bytes >> 8; b[3] = h.bytes;
   b[4] = h.crc >> 24; b[5] = h.crc >> 16; b[6] = h.crc >> 8; b[7] = h.crc;
-  xfwrite(b, 8, des);
+}
+static void write_block_header(FILE * des, block_hdr h) {
+  u8 b[8];  pack_block_header(b, h);  xfwrite(b, 8, des);
 }
 static block_hdr parse_block_header(u8 b[8], bool force) {
   block_hdr h;  bool valid = b[0] == 'X';
@@ -250,57 +379,513 @@ static block_hdr parse_block_header(u8 b[8], bool force) {
     return h;
   }
 }
-static void encode4(FILE * in, FILE * out, int ifactor) {
+
+// ============================================================================
+//  The trailer follows the last lace and summarises the archive, so that the
+//  decoder can size the output and detect truncation before decoding. Like
+//  the header, it is a shortened RS codeword: TRAILER_DATA bytes of data and
+//  the parity, TRAILER_SIZE bytes in all, which is less than any lace. Laces
+//  have a fixed size on disk, so no lace index is needed: lace i starts at
+//  byte HEADER_SIZE + i * (ibs * N + BLOCK_HDR_SIZE), and the trailer is what
+//  is left past the last whole lace. `chain' is the CRC32C of the big-endian
+//  lace CRCs, `chain_prev' is the same without the last lace. Sidecars end
+//  with the same record.
+// ============================================================================
+#define BLOCK_HDR_SIZE 8
+#define TRAILER_DATA 27
+#define TRAILER_SIZE (TRAILER_DATA + N - K)
+typedef struct { u64 size, laces; u32 chain, chain_prev; } trailer_t;
+static void trailer_add_lace(trailer_t * t, block_hdr h) {
+  u8 b[4] = { h.crc >> 24, h.crc >> 16, h.crc >> 8, h.crc };
+  t->chain_prev = t->chain;  t->chain = crc32c_update(t->chain, b, 4);
+  t->size += h.bytes;  t->laces++;
+}
+static void trailer_codeword(u8 out[N], trailer_t t, int ifactor) {
+  u8 h[K] = { 0 };
+  h[0] = 'X'; h[1] = 'T'; h[2] = ifactor + '0';
+  Fi(8, h[3 + i] = t.size >> (56 - 8 * i); h[11 + i] = t.laces >> (56 - 8 * i))
+  Fi(4, h[19 + i] = t.chain >> (24 - 8 * i);
+        h[23 + i] = t.chain_prev >> (24 - 8 * i))
+  rse32(h, out);
+}
+static void pack_trailer(u8 b[TRAILER_SIZE], trailer_t t, int ifactor) {
+  u8 out[N];  trailer_codeword(out, t, ifactor);
+  memcpy(b, out, TRAILER_DATA); memcpy(b + TRAILER_DATA, out + K, N - K);
+}
+static void write_trailer(FILE * des, trailer_t t, int ifactor) {
+  u8 b[TRAILER_SIZE];  pack_trailer(b, t, ifactor);
+  xfwrite(b, TRAILER_SIZE, des);
+}
+static bool trailer_from_codeword(u8 out[N], int ifactor, trailer_t * t) {
+  Fi0(K, TRAILER_DATA, if (out[i]) return false)
+  if (out[0] != 'X' || out[1] != 'T' || out[2] != ifactor + '0') return false;
+  memset(t, 0, sizeof(trailer_t));
+  Fi(8, t->size = (t->size << 8) | out[3 + i];
+        t->laces = (t->laces << 8) | out[11 + i])
+  Fi(4, t->chain = (t->chain << 8) | out[19 + i];
+        t->chain_prev = (t->chain_prev << 8) | out[23 + i])
+  return true;
+}
+// Returns false if the TRAILER_SIZE bytes at `b' do not decode to a trailer.
+static bool unpack_trailer(const u8 * b, int ifactor, trailer_t * t) {
+  u8 cw[N] = { 0 };
+  memcpy(cw, b, TRAILER_DATA);  memcpy(cw + K, b + TRAILER_DATA, N - K);
+  return rsd32(cw) >= 0 && trailer_from_codeword(cw, ifactor, t);
+}
+static bool read_trailer(FILE * f, sz off, int ifactor, trailer_t * t) {
+  u8 b[TRAILER_SIZE];  xfseek(f, off);
+  return xfread(b, TRAILER_SIZE, f) == TRAILER_SIZE
+      && unpack_trailer(b, ifactor, t);
+}
+static bool trailer_consistent(trailer_t t, sz ibs) {
+  if (!t.laces) return !t.size;
+  return t.size <= t.laces * ibs * K && t.size > (t.laces - 1) * ibs * K;
+}
+// The amount of data in lace `l' by the trailer, or -1 for a lace past the
+// last one it records.
+static sz trailer_bytes(trailer_t t, sz ibs, sz l) {
+  return l < t.laces ? MIN(ibs * K, t.size - l * ibs * K) : (sz) -1;
+}
+static void check_trailer(trailer_t expected, trailer_t actual,
+                          bool force, bool quiet) {
+  if (expected.laces != actual.laces || expected.size != actual.size
+   || expected.chain != actual.chain) {
+    if (!quiet)
+      fprintf(stderr, "Trailer mismatch: expected %llu laces (%llu bytes), "
+        "got %llu laces (%llu bytes)%s.\n",
+        (unsigned long long) expected.laces, (unsigned long long) expected.size,
+        (unsigned long long) actual.laces, (unsigned long long) actual.size,
+        expected.chain != actual.chain ? ", lace checksums differ" : "");
+    if (!force) exit(1);
+  }
+}
+// Encodes `n' bytes of `in_buffer' (zero-padded in place) into `o2'.
+static block_hdr encode_lace(u8 * in_buffer, sz n, u8 * o1, u8 * o2,
+                             int ifactor) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  if(n < ibs * K) memset(in_buffer + n, 0, ibs * K - n);
+  u32 crc = rse_lace(in_buffer, o1, n, ifactor);
+  do_interlacing(o1, o2, ifactor);
+  return (block_hdr) { n, crc };
+}
+// ============================================================================
+//  Zero laces. All-zero data encodes to all-zero codewords, so such laces
+//  need neither the parity nor the interlacing computed, and long runs of
+//  zeros are skipped over on output to leave holes in sparse files. Holes
+//  are only left in files opened by xpar: standard output could be opened
+//  for appending, and seeking would not work as expected.
+// ============================================================================
+static const u8 zeros[4096];
+static bool is_zero(u8 * p, sz n) {
+  return !n || (!p[0] && !memcmp(p, p + 1, n - 1));
+}
+// Full laces all have the same size, so the last result is remembered. Lace
+// sizes fit in 24 bits, so the size and the CRC are kept in a single word.
+static u32 zero_crc(sz n) {
+  static u64 memo = 0;  u64 m;  u32 crc = 0;
+  pool_lock();  m = memo;  pool_unlock();
+  if (m >> 32 == n) return (u32) m;
+  for (sz k, left = n; left; left -= k)
+    k = MIN(left, sizeof(zeros)), crc = crc32c_update(crc, (u8 *) zeros, k);
+  m = ((u64) n << 32) | crc;
+  pool_lock();  memo = m;  pool_unlock();
+  return crc;
+}
+// The last byte is always written, so that the file is extended as needed.
+// Whatever the file held before is released, so rewritten zeros are sparse.
+static void put_zeros(FILE * out, sz n) {
+  if (n > sizeof(zeros) && out != stdout && xfpunch(out, n - 1)) n = 1;
+  for (sz k; n; n -= k) k = MIN(n, sizeof(zeros)), xfwrite(zeros, k, out);
+}
+static block_hdr zero_lace(FILE * out, sz n, int ifactor) {
+  put_zeros(out, compute_interlacing_bs(ifactor) * N);
+  return (block_hdr) { n, zero_crc(n) };
+}
+// ============================================================================
+//  Checkpoints. With --resume, the progress of a long encode or decode is
+//  saved next to the output every few seconds: the running trailer state
+//  (the amount of laces and data done and the lace CRC chain) along with the
+//  size and modification time of the input, which must not change in the
+//  meantime. The output is synced before each checkpoint is written, so that
+//  it never refers to data that could still be lost. Checkpoints are written
+//  to a temporary file first and renamed over the previous one.
+// ============================================================================
+#define CKPT_SIZE 56
+#define CKPT_INTERVAL 5 // Seconds.
+typedef struct {
+  char * name;  u8 mode;  int ifactor;  u64 isize, imtime;
+  trailer_t tr;  u64 ecc;  time_t last;
+} ckpt_t;
+static void put_be(u8 * p, u64 v, int n) { Fi(n, p[i] = v >> (8 * (n - 1 - i))) }
+static u64 get_be(u8 * p, int n) {
+  u64 v = 0;  Fi(n, v = (v << 8) | p[i])  return v;
+}
+static bool ckpt_due(ckpt_t * c) {
+  return c && time(NULL) - c->last >= CKPT_INTERVAL;
+}
+static void write_ckpt(ckpt_t * c, FILE * out, trailer_t tr, u64 ecc) {
+  u8 b[CKPT_SIZE];  char * tmp;  FILE * f;
+  xfsync(out);
+  b[0] = 'X'; b[1] = 'C'; b[2] = c->mode; b[3] = c->ifactor + '0';
+  put_be(b + 4, c->isize, 8);  put_be(b + 12, c->imtime, 8);
+  put_be(b + 20, tr.laces, 8);  put_be(b + 28, tr.size, 8);
+  put_be(b + 36, tr.chain, 4);  put_be(b + 40, tr.chain_prev, 4);
+  put_be(b + 44, ecc, 8);  put_be(b + 52, crc32c(b, 52), 4);
+  if (asprintf(&tmp, "%s.tmp", c->name) == -1) FATAL_PERROR("asprintf");
+  if (!(f = fopen(tmp, "wb"))) FATAL_PERROR("fopen");
+  xfwrite(b, CKPT_SIZE, f);  xfclose(f);
+  if (rename(tmp, c->name)) FATAL_PERROR("rename");
+  free(tmp);  c->last = time(NULL);
+}
+// Loads the checkpoint for `c', returns false if there is none.
+static bool read_ckpt(ckpt_t * c) {
+  FILE * f = fopen(c->name, "rb");  u8 b[CKPT_SIZE];
+  if (!f) return false;
+  sz n = xfread(b, CKPT_SIZE, f);  fclose(f);
+  if (n != CKPT_SIZE || b[0] != 'X' || b[1] != 'C' || b[3] < '1' || b[3] > '3'
+   || get_be(b + 52, 4) != crc32c(b, 52))
+    FATAL("Invalid checkpoint `%s'.", c->name);
+  if (b[2] != c->mode)
+    FATAL("The checkpoint `%s' is for a different operation.", c->name);
+  if (get_be(b + 4, 8) != c->isize || get_be(b + 12, 8) != c->imtime)
+    FATAL("The input has changed since the checkpoint `%s'.", c->name);
+  c->ifactor = b[3] - '0';
+  c->tr.laces = get_be(b + 20, 8);  c->tr.size = get_be(b + 28, 8);
+  c->tr.chain = get_be(b + 36, 4);  c->tr.chain_prev = get_be(b + 40, 4);
+  c->ecc = get_be(b + 44, 8);
+  return true;
+}
+// ============================================================================
+//  Page cache. Files are read and written once, front to back. Input is read
+//  ahead a window at a time and dropped from the page cache a window behind
+//  the current position; output is written back as each window fills and
+//  dropped once the write completes. The page cache footprint stays at a few
+//  windows however large the files are.
+// ============================================================================
+#define CACHE_WINDOW ((sz) 32 << 20)
+// `map', if not NULL, maps the `size' bytes of `f' starting at `base'. All
+// positions are offsets into the file.
+typedef struct {
+  FILE * f; u8 * map; sz base, size, next, behind, mid, window;
+} cache_t;
+static cache_t cache_init(FILE * f, u8 * map, sz base, sz size) {
+  return (cache_t) { f, map, base, size, base, base, base, CACHE_WINDOW };
+}
+// Output is written back every `--sync=incremental:N' laces of `lace' bytes.
+static cache_t cache_out(FILE * f, sz base, sz lace) {
+  cache_t c = cache_init(f, NULL, base, 0);
+  if (xsync_laces()) c.window = xsync_laces() * lace;
+  return c;
+}
+static void cache_read(cache_t * c, sz pos) {
+  if (pos < c->next) return;
+  if (c->map)
+    xmadvise(c->map + (pos - c->base),
+             MIN(2 * CACHE_WINDOW, c->base + c->size - pos), true);
+  else xfadvise(c->f, pos, 2 * CACHE_WINDOW, true);
+  if (pos >= c->behind + 2 * CACHE_WINDOW) {
+    sz end = pos - CACHE_WINDOW;
+    if (c->map) xmadvise(c->map + (c->behind - c->base), end - c->behind, false);
+    xfadvise(c->f, c->behind, end - c->behind, false);
+    c->behind = end;
+  }
+  c->next = pos + CACHE_WINDOW;
+}
+static void cache_write(cache_t * c, sz pos) {
+  if (pos < c->next) return;
+  if (fflush(c->f)) FATAL_PERROR("fflush");
+  xfwriteback(c->f, c->mid, pos - c->mid, false);
+  xfwriteback(c->f, c->behind, c->mid - c->behind, true);
+  c->behind = c->mid, c->mid = pos, c->next = pos + c->window;
+}
+// Encodes a lace and writes it out with its block header. When writing to a
+// pipe, the lace is encoded straight into a buffer handed to the pipe.
+static block_hdr put_lace(u8 * in_buffer, sz n, u8 * o1, u8 * o2, FILE * out,
+                          xpipe_t * zc, int ifactor) {
+  sz ibs = compute_interlacing_bs(ifactor);  u8 * b = zc ? xpipe_buffer(zc) : o2;
+  block_hdr h = encode_lace(in_buffer, n, o1, b, ifactor);
+  if (zc) {
+    pack_block_header(b + ibs * N, h);
+    xpipe_write(zc, ibs * N + BLOCK_HDR_SIZE);
+  } else xfwrite(b, ibs * N, out), write_block_header(out, h);
+  return h;
+}
+// Both encoders either start a new archive or, given the trailer state of an
+// existing one, continue it at the current position of `out', which must be
+// the end of the file.
+static void encode4(FILE * in, FILE * out, int ifactor, trailer_t * resume,
+                    ckpt_t * ck) {
   notty(out);
   u8 * in_buffer, * o1, * o2;
   int ibs = compute_interlacing_bs(ifactor);
-  in_buffer = xmalloc(ibs * K), o1 = xmalloc(ibs * N), o2 = xmalloc(ibs * N);
-  block_hdr bhdr;  write_header(out, ifactor);
+  in_buffer = xlace_alloc(ibs * K);
+  o1 = xlace_alloc(ibs * N), o2 = xlace_alloc(ibs * N);
+  block_hdr bhdr;  trailer_t tr = { 0 };
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  if (resume) tr = *resume; else write_header(out, 'P', ifactor);
+  cache_t ci = cache_init(in, NULL, tr.size, 0);
+  cache_t co = cache_out(out, HEADER_SIZE + tr.laces * lace_size, lace_size);
+  xpipe_t * zc = xpipe_open(out, lace_size);
   for (size_t n; n = xfread(in_buffer, ibs * K, in); ) {
-    if(n < ibs * K) memset(in_buffer + n, 0, ibs * K - n);
-  #if defined(XPAR_OPENMP)
-    #pragma omp parallel for if(ifactor == 3)
-  #endif
-    Fi(ibs, rse32(in_buffer + i * K, o1 + i * N));
-    do_interlacing(o1, o2, ifactor);
-    xfwrite(o2, ibs * N, out);
-    bhdr.bytes = n; bhdr.crc = crc32c(in_buffer, n);
-    write_block_header(out, bhdr);
+    if (is_zero(in_buffer, n))
+      bhdr = zero_lace(out, n, ifactor), write_block_header(out, bhdr);
+    else bhdr = put_lace(in_buffer, n, o1, o2, out, zc, ifactor);
+    trailer_add_lace(&tr, bhdr);
+    cache_read(&ci, tr.size);
+    cache_write(&co, HEADER_SIZE + tr.laces * lace_size);
+    if (ckpt_due(ck)) write_ckpt(ck, out, tr, 0);
   }
-  free(in_buffer), free(o1), free(o2); xfclose(out);
+  write_trailer(out, tr, ifactor);  xpipe_close(zc);
+  xlace_free(in_buffer), xlace_free(o1), xlace_free(o2); xfclose(out);
 }
 #ifdef XPAR_ALLOW_MAPPING
-static void encode3(mmap_t in, FILE * out, int ifactor) {
+// `probe', if not NULL, is the mapped file opened as a stream and is used to
+// find holes in it without touching the mapping.
+static void encode3(mmap_t in, FILE * probe, FILE * out, int ifactor,
+                    trailer_t * resume, ckpt_t * ck) {
   notty(out);
   u8 * in_buffer, * o1, * o2;
   int ibs = compute_interlacing_bs(ifactor);
-  in_buffer = xmalloc(ibs * K), o1 = xmalloc(ibs * N), o2 = xmalloc(ibs * N);
-  block_hdr bhdr;  write_header(out, ifactor);
-  for (sz n;
-       n = MIN(in.size, ibs * K), memcpy(in_buffer, in.map, n), n;
-       in.size -= n, in.map += n) {
-    if(n < ibs * K) memset(in_buffer + n, 0, ibs * K - n);
-  #if defined(XPAR_OPENMP)
-    #pragma omp parallel for if(ifactor == 3)
-  #endif
-    Fi(ibs, rse32(in_buffer + i * K, o1 + i * N));
-    do_interlacing(o1, o2, ifactor);
-    xfwrite(o2, ibs * N, out);
-    bhdr.bytes = n; bhdr.crc = crc32c(in_buffer, n);
-    write_block_header(out, bhdr);
+  in_buffer = xlace_alloc(ibs * K);
+  o1 = xlace_alloc(ibs * N), o2 = xlace_alloc(ibs * N);
+  block_hdr bhdr;  trailer_t tr = { 0 };
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  if (resume) tr = *resume; else write_header(out, 'P', ifactor);
+  cache_t ci = cache_init(probe, in.map, tr.size, in.size);
+  cache_t co = cache_out(out, HEADER_SIZE + tr.laces * lace_size, lace_size);
+  xpipe_t * zc = xpipe_open(out, lace_size);
+  for (sz n, off = 0, data = 0, hole = 0;
+       n = MIN(in.size, ibs * K);
+       in.size -= n, in.map += n, off += n) {
+    if (off >= hole) xdata_extent(probe, off, &data, &hole);
+    if (off + n <= data || is_zero(in.map, n)) {
+      bhdr = zero_lace(out, n, ifactor), write_block_header(out, bhdr);
+    } else {
+      // Only the last lace is padded, so only it needs copying.
+      u8 * src = in.map;
+      if (n < ibs * K) src = memcpy(in_buffer, in.map, n);
+      bhdr = put_lace(src, n, o1, o2, out, zc, ifactor);
+    }
+    trailer_add_lace(&tr, bhdr);
+    cache_read(&ci, tr.size);
+    cache_write(&co, HEADER_SIZE + tr.laces * lace_size);
+    if (ckpt_due(ck)) write_ckpt(ck, out, tr, 0);
   }
-  free(in_buffer), free(o1), free(o2); xfclose(out);
+  write_trailer(out, tr, ifactor);  xpipe_close(zc);
+  xlace_free(in_buffer), xlace_free(o1), xlace_free(o2); xfclose(out);
 }
 #endif
+// ============================================================================
+//  Replicas. Laces that fail to decode or whose CRC does not match are read
+//  again from a second copy of the archive, so that I/O on the replica stays
+//  proportional to the damage. Each codeword is taken from whichever copy
+//  decodes; when neither does, the positions where the copies differ are
+//  treated as erasures, which corrects up to 32 errors per codeword instead
+//  of 16, as long as the copies are not damaged the same way.
+// ============================================================================
+typedef struct { FILE * f; u64 read, recovered; } replica_t;
+static void check_replica(replica_t * rep, int ifactor, int force) {
+  if (read_header(rep->f, force, ifactor) != ifactor)
+    FATAL("The replica does not match the archive.");
+  rs_pcheck_gentab();
+}
+typedef struct { u8 * ca, * cb;  int lost; } replica_job_t;
+static void replica_range(void * ctx, sz lo, sz hi) {
+  replica_job_t * j = ctx;  int lost = 0;
+  for (sz i = lo; i < hi; i++) {
+    u8 * x = j->ca + i * N, * y = j->cb + i * N, c[N];  int e[N], m = 0;
+    memcpy(c, x, N);
+    if (rsd32(c) >= 0) { memcpy(x, c, N); continue; }
+    memcpy(c, y, N);
+    if (rsd32(c) >= 0) { memcpy(x, c, N); continue; }
+    Fj(N, if (x[j] != y[j]) e[m++] = j)
+    if (!rs_erasures(x, e, m)) lost++;
+  }
+  pool_add(&j->lost, lost);
+}
+// Recovers the data of lace `l' into `out_buffer', given the lace read from
+// the primary copy. Accepts the block header of either copy.
+static bool replica_lace(replica_t * rep, sz l, int ifactor, u8 * lace,
+                         block_hdr * bhdr, sz size, u8 * out_buffer,
+                         u32 * crc) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;  int lost = 0;
+  u8 * b = xmalloc(lace_size), * ca = xmalloc(ibs * N), * cb = xmalloc(ibs * N);
+  xfseek(rep->f, HEADER_SIZE + l * lace_size);
+  sz n = xfread(b, lace_size, rep->f);  rep->read += n;
+  if (n < lace_size) { free(b), free(ca), free(cb);  return false; }
+  do_interlacing(lace, ca, ifactor);  do_interlacing(b, cb, ifactor);
+  replica_job_t j = { ca, cb, 0 };
+  lace_for(ibs, ifactor, replica_range, &j);  lost = j.lost;
+  u8 * rh = b + ibs * N;  block_hdr rb = parse_block_header(rh, true);
+  if (!lost) {
+    *crc = 0;
+    Fi(ibs, sz m = cw_bytes(i, size);
+      *crc = crc32c_copy(*crc, out_buffer + i * K, ca + i * N, m);
+      memcpy(out_buffer + i * K + m, ca + i * N + m, K - m))
+    if (*crc != bhdr->crc && rh[0] == 'X' && rb.crc == *crc
+     && MIN(ibs * K, rb.bytes) == size)
+      *bhdr = rb;
+  }
+  free(b), free(ca), free(cb);
+  if (lost || *crc != bhdr->crc) return false;
+  rep->recovered++;
+  return true;
+}
+// ============================================================================
+//  Resynchronisation. Laces have fixed offsets, so a single inserted or
+//  deleted byte misaligns the rest of the archive. When a block header is not
+//  where it is expected and the next one is not either, the archive around
+//  the expected offset is scanned with memmem for a block header that is
+//  followed by another one a lace later, and decoding continues from there.
+//  The lace spanning the damage is pieced together from its copy aligned to
+//  its start and its copy aligned to its end, the seam being moved in steps
+//  of the longest correctable burst until it decodes. Streams are not read
+//  twice: the window is put together from the lace in hand and the bytes
+//  read ahead, and what is left of it is carried over to the reads that
+//  follow. The last lace is sized by the trailer once the window reaches the
+//  end of the stream.
+// ============================================================================
+static void block_pattern(u8 p[4], sz bytes) {
+  p[0] = 'X'; p[1] = bytes >> 16; p[2] = bytes >> 8; p[3] = bytes;
+}
+static bool hdr_at(u8 * p, sz avail, u8 pat[4]) {
+  return avail >= 4 && !memcmp(p, pat, 4);
+}
+// Whether a block header at offset `h' of `win' is followed by another one,
+// or by the end of the archive (where `win' ends if `at_end'), with or
+// without its trailer.
+static bool followed(u8 * win, sz len, sz h, sz ibs, bool at_end) {
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  if (h + lace_size + 4 <= len) {
+    u8 * p = win + h + lace_size;  sz bytes = (p[1] << 16) | (p[2] << 8) | p[3];
+    return p[0] == 'X' && bytes <= ibs * K;
+  }
+  return at_end && (h + BLOCK_HDR_SIZE == len
+                 || h + BLOCK_HDR_SIZE + TRAILER_SIZE == len);
+}
+// Finds the block header matching `pat' nearest to offset `e' of `win', less
+// than a lace away. Returns false if there is none, or if the laces are still
+// aligned at `e' and only the block header there is damaged.
+static bool find_shift(u8 * win, sz len, sz e, u8 pat[4], sz ibs, bool at_end,
+                       sz * at) {
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE, dist = 0;  bool found = false;
+  if (followed(win, len, e, ibs, at_end)) return false;
+  u8 * p = win + (e >= lace_size ? e - lace_size + 1 : 0);
+  for (; (p = memmem(p, win + len - p, pat, 4)); p++) {
+    sz h = p - win, d = h > e ? h - e : e - h;
+    if (h > e && (d >= lace_size || (found && d >= dist))) break;
+    if (followed(win, len, h, ibs, at_end) && (!found || d < dist))
+      found = true, dist = d, *at = h;
+  }
+  return found;
+}
+// Decodes a lace without reporting anything, returns whether it checks out.
+static bool trial_lace(u8 * lace, u8 * hdr, u8 * in2, u8 * buf, int ifactor) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  block_hdr b = parse_block_header(hdr, true);
+  rsd_job_t j = { .cw = in2, .out = buf, .bytes = b.bytes };
+  if (hdr[0] != 'X' || b.bytes > ibs * K) return false;
+  do_interlacing(lace, in2, ifactor);
+  rsd_lace(&j, ifactor);
+  return !j.lost && j.crc == b.crc;
+}
+// `start' holds the lace as read, the lace aligned to its end precedes the
+// block header found at `hdr', of which `avail' bytes are available. On
+// success, the spliced lace is left in `start'.
+static bool splice_lace(u8 * start, u8 * hdr, sz avail, u8 * tmp, u8 * in2,
+                        u8 * buf, int ifactor) {
+  sz ibs = compute_interlacing_bs(ifactor), step = 16 * ibs;
+  sz lo = ibs * N - MIN(avail, ibs * N);
+  for (sz p = lo; p < ibs * N + step; p += step) {
+    sz q = MIN(p, ibs * N);
+    memcpy(tmp, start, q);  memcpy(tmp + q, hdr - (ibs * N - q), ibs * N - q);
+    if (trial_lace(tmp, hdr, in2, buf, ifactor)) {
+      memcpy(start, tmp, ibs * N);
+      return true;
+    }
+  }
+  return false;
+}
+typedef struct { FILE * f;  u8 * win;  sz at, len; } carry_t;
+static sz carry_read(carry_t * c, u8 * buf, sz n) {
+  sz k = MIN(n, c->len - c->at);
+  memcpy(buf, c->win + c->at, k);  c->at += k;
+  return k < n ? k + xfread(buf + k, n - k, c->f) : k;
+}
+// Looks for the block header of lace `l', read into `in1', after the `hn'
+// bytes read in its place into `hdr' did not match. The `back' bytes of the
+// stream before the lace are the end of `prev'. Returns false if the laces
+// are still aligned; otherwise `*at' is the offset of the block header found
+// in `c->win', where the lace is expected to end at `back + ibs * N', and
+// reading continues after it.
+static bool stream_shift(carry_t * c, u8 * prev, sz back, u8 * in1, u8 * hdr,
+                         sz hn, int ifactor, sz l, trailer_t * expect,
+                         bool * expected, sz * at) {
+  sz ibs = compute_interlacing_bs(ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  sz e = back + ibs * N, rest = c->len - c->at;
+  sz want = e + 2 * lace_size + 4 + TRAILER_SIZE;  u8 pat[4];
+  if (!c->win) c->win = xmalloc(4 * lace_size + TRAILER_SIZE + 4);
+  memmove(c->win + e + hn, c->win + c->at, rest);
+  memcpy(c->win, prev + BLOCK_HDR_SIZE - back, back);
+  memcpy(c->win + back, in1, ibs * N);  memcpy(c->win + e, hdr, hn);
+  c->at = e + hn, c->len = c->at + rest;
+  if (c->len < want) c->len += xfread(c->win + c->len, want - c->len, c->f);
+  bool at_end = c->len < want;
+  if (at_end && !*expected)
+    *expected = unpack_trailer(c->win + c->len - TRAILER_SIZE, ifactor, expect)
+              && trailer_consistent(*expect, ibs);
+  block_pattern(pat, *expected && l < expect->laces
+                ? MIN(ibs * K, expect->size - l * ibs * K) : ibs * K);
+  if (hdr_at(hdr, hn, pat)
+   || !find_shift(c->win, c->len, e, pat, ibs, at_end, at))
+    return false;
+  c->at = MIN(*at + BLOCK_HDR_SIZE, c->len);
+  return true;
+}
+static void report_shift(unsigned lace, u8 * found, u8 * expected,
+                         bool quiet) {
+  if (!quiet)
+    fprintf(stderr, "Lace %u: %zu bytes %s, resynchronised.\n", lace,
+      found > expected ? (sz) (found - expected) : (sz) (expected - found),
+      found > expected ? "inserted" : "deleted");
+}
+// Both decoders continue from the state in `ck', if given. `out' must be
+// positioned at the end of the data decoded so far.
 static void decode4(FILE * in, FILE * out, int force, int ifactor_override,
-             bool quiet, bool verbose) {
+                    bool quiet, bool verbose, ckpt_t * ck, replica_t * rep) {
   notty(in);
-  u8 * in1, * in2, * out_buffer;  int laces = 0, ecc = 0;
-  block_hdr bhdr; u8 tmp[8];
+  u8 * in1, * in2, * own, * out_buffer;  int laces = 0, ecc = 0;
+  block_hdr bhdr; u8 tmp[8], prev[8];  sz back = 0; // Bytes of `prev' read.
+  sz pending = 0; // Zero bytes not yet written.
+  trailer_t tr, chk = { 0 }, expect;
+  bool has_trailer = false, expected = false;
   int ifactor = read_header(in, force, ifactor_override);
+  if (rep) check_replica(rep, ifactor, force);
   sz ibs = compute_interlacing_bs(ifactor);
-  in1 = xmalloc(ibs * N), in2 = xmalloc(ibs * N), out_buffer = xmalloc(ibs * K);
-  for (sz n; n = xfread(in1, ibs * N, in); laces++) {
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE, pos = HEADER_SIZE;
+  u8 pat[4], * spl = NULL;  carry_t c = { in, NULL, 0, 0 };
+  in1 = xlace_alloc(ibs * N), in2 = xlace_alloc(ibs * N);
+  out_buffer = own = xlace_alloc(ibs * K);
+  xpipe_t * zc = xpipe_open(out, ibs * K);
+  if (ck) {
+    chk = ck->tr, laces = chk.laces, ecc = ck->ecc, ck->ifactor = ifactor;
+    xfseek(in, pos = HEADER_SIZE + chk.laces * lace_size);
+  }
+  cache_t ci = cache_init(in, NULL, pos, 0);
+  cache_t co = cache_out(out, chk.size, ibs * K);
+  for (sz n; n = carry_read(&c, in1, ibs * N); laces++, pos += n + 8) {
+    if (zc) out_buffer = xpipe_buffer(zc);
+    block_pattern(pat, !expected ? ibs * K : laces < expect.laces
+                  ? MIN(ibs * K, expect.size - laces * ibs * K) : ibs * K);
+    // Only the trailer is left once the laces are read.
+    if (n == TRAILER_SIZE) {
+      if (!(has_trailer = unpack_trailer(in1, ifactor, &tr))) {
+        if (!quiet) fprintf(stderr, "Invalid trailer.\n");
+        if (!force) exit(1);
+      }
+      break;
+    }
     if(n < ibs * N) {
       if (!quiet)
         fprintf(stderr, "Short read, lace %u (bytes %zu-%zu).\n",
@@ -308,109 +893,488 @@ static void decode4(FILE * in, FILE * out, int force, int ifactor_override,
       if (!force) exit(1);
       memset(in1 + n, 0, ibs * N - n);
     }
-    if(xfread(tmp, 8, in) != 8) {
+    sz hn = carry_read(&c, tmp, 8), h;
+    if(hn != 8) {
       if (!quiet)
         fprintf(stderr,
           "Short read (block header), lace %u (bytes %zu-%zu).\n",
           laces, laces * ibs * N, laces * ibs * N + n - 1);
       if (!force) exit(1);
     }
-    bhdr = parse_block_header(tmp, force);
-    do_interlacing(in1, in2, ifactor);
-  #if defined(XPAR_OPENMP)
-    #pragma omp parallel for if(ifactor == 3)
-  #endif
-    Fi(ibs,
-      int n = rsd32(in2 + i * N);
-      if (n < 0) {
-        // POSIX requires single I/O function calls to be thread-safe.
-        {
-        const unsigned lace_ibs = laces * ibs + i;
+    if (n == ibs * N && !hdr_at(tmp, hn, pat)
+     && stream_shift(&c, prev, back, in1, tmp, hn, ifactor, laces, &expect,
+                     &expected, &h)) {
+      if (!spl) spl = xlace_alloc(ibs * N);
+      report_shift(laces, c.win + h, c.win + back + n, quiet);
+      if (!trial_lace(in1, c.win + h, in2, out_buffer, ifactor))
+        splice_lace(in1, c.win + h, h, spl, in2, out_buffer, ifactor);
+      memcpy(tmp, c.win + h, 8);  pos += h - back - n;
+    }
+    bhdr = parse_block_header(tmp, force);  memcpy(prev, tmp, 8), back = 8;
+    bool zero = is_zero(in1, ibs * N);  int lost = 0;
+    sz size = MIN(ibs * K, bhdr.bytes);
+    u32 crc = zero ? zero_crc(size) : 0;
+    if (!zero) {
+      do_interlacing(in1, in2, ifactor);
+      rsd_job_t j = { .cw = in2, .out = out_buffer, .report = !rep,
+                      .quiet = quiet, .force = force, .lace = laces,
+                      .bytes = size };
+      rsd_lace(&j, ifactor);  ecc += j.ecc;  lost = j.lost;  crc = j.crc;
+    }
+    if ((lost || crc != bhdr.crc) && rep) {
+      if (replica_lace(rep, laces, ifactor, in1, &bhdr, size, out_buffer, &crc))
+        zero = false;
+      else if (lost) {
         if (!quiet)
-          fprintf(stderr,
-            "Block %u (lace %u, bytes %u-%u) irrecoverable.\n",
-            lace_ibs, laces, lace_ibs * N, lace_ibs * N + N - 1);
+          fprintf(stderr, "Lace %u: %d blocks irrecoverable in both copies.\n",
+            laces, lost);
         if (!force) exit(1);
-        }
-      } else ecc += n;
-      memcpy(out_buffer + i * K, in2 + i * N, K);
-    )
-    sz size = MIN(ibs * K, bhdr.bytes);
-    u32 crc = crc32c(out_buffer, size);
+      }
+    }
     if (crc != bhdr.crc) {
       if (!quiet)
         fprintf(stderr, "CRC mismatch, block %zu (lace %u, bytes %zu-%zu).\n",
           laces * ibs, laces, laces * ibs * N, laces * ibs * N + size - 1);
       if (!force) exit(1);
     }
-    xfwrite(out_buffer, size, out);
+    if (zero) pending += size;
+    else {
+      put_zeros(out, pending), pending = 0;
+      if (zc) xpipe_write(zc, size); else xfwrite(out_buffer, size, out);
+    }
+    trailer_add_lace(&chk, (block_hdr) { size, crc });
+    cache_read(&ci, pos + n + 8);  cache_write(&co, chk.size - pending);
+    if (ckpt_due(ck)) {
+      put_zeros(out, pending), pending = 0;
+      write_ckpt(ck, out, chk, ecc);
+    }
   }
-  free(in1), free(in2), free(out_buffer); xfclose(out);
+  put_zeros(out, pending);
+  if (has_trailer) check_trailer(tr, chk, force, quiet);
+  if (rep && !quiet && verbose)
+    fprintf(stderr, "Recovered %llu laces from the replica "
+      "(%llu bytes read).\n", (unsigned long long) rep->recovered,
+      (unsigned long long) rep->read);
+  xlace_free(in1), xlace_free(in2), xlace_free(own), xlace_free(spl);
+  xpipe_close(zc);
+  free(c.win);  xfclose(out);
   if (!quiet && verbose)
     fprintf(stderr, "Decoded %u laces, %u errors corrected.\n", laces, ecc);
 }
 #ifdef XPAR_ALLOW_MAPPING
-static void decode3(mmap_t in, FILE * out, int force, int ifactor_override,
-             bool quiet, bool verbose) {
-  u8 * in1, * in2, * out_buffer;  int laces = 0, ecc = 0;
-  block_hdr bhdr; u8 tmp[8];
-  int ifactor = read_header_from_map(in, force, ifactor_override);
-  in.size -= 5 + N - K; in.map += 5 + N - K; // Skip the header.
-  sz ibs = compute_interlacing_bs(ifactor);
-  in1 = xmalloc(ibs * N), in2 = xmalloc(ibs * N), out_buffer = xmalloc(ibs * K);
-  for (sz n;
-      n = MIN(in.size, ibs * N), memcpy(in1, in.map, n),
-          in.size -= n, in.map += n, n
-      ; laces++) {
-    if(n < ibs * N) {
-      if (!quiet)
-        fprintf(stderr, "Short read, lace %u (bytes %zu-%zu).\n",
-          laces, laces * ibs * N, laces * ibs * N + n - 1);
-      if (!force) exit(1);
-      memset(in1 + n, 0, ibs * N - n);
-    }
-    if (in.size < 8) {
-      if (!quiet)
-        fprintf(stderr,
-          "Short read (block header), lace %u (bytes %zu-%zu).\n",
-          laces, laces * ibs * N, laces * ibs * N + n - 1);
-      if (!force) exit(1);
-      memcpy(tmp, in.map, in.size); in.map += in.size; in.size = 0;
-    } else {
-      memcpy(tmp, in.map, 8); in.size -= 8; in.map += 8;
-    }
-    bhdr = parse_block_header(tmp, force);
-    do_interlacing(in1, in2, ifactor);
-  #if defined(XPAR_OPENMP)
-    #pragma omp parallel for if(ifactor == 3)
-  #endif
-    Fi(ibs,
-      int n = rsd32(in2 + i * N);
-      if (n < 0) {
-        {
-        const unsigned lace_ibs = laces * ibs + i;
-        if (!quiet)
-          fprintf(stderr,
-            "Block %u (lace %u, bytes %u-%u) irrecoverable.\n",
-            lace_ibs, laces, lace_ibs * N, lace_ibs * N + N - 1);
-        if (!force) exit(1);
+// Strips the trailer off a mapped archive with the header already skipped.
+// Returns 1 if the trailer is present and agrees with the archive size, -1 if
+// it does not or the archive has stray bytes, 0 for archives without one.
+static int map_trailer(mmap_t * in, int ifactor, sz ibs, trailer_t * tr,
+                       bool force, bool quiet) {
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE, rest = in->size % lace_size;
+  if (!rest) return 0;
+  bool ok = in->size >= TRAILER_SIZE
+         && unpack_trailer(in->map + in->size - TRAILER_SIZE, ifactor, tr)
+         && trailer_consistent(*tr, ibs);
+  if (rest == TRAILER_SIZE) {
+    in->size -= TRAILER_SIZE;
+    if (ok && tr->laces == in->size / lace_size) return 1;
+    if (!quiet)
+      fprintf(stderr, ok ? "Trailer does not match the archive.\n"
+                         : "Invalid trailer.\n");
+    if (!force) exit(1);
+    return -1;
+  } else if (ok) {
+    // Bytes inserted or deleted: the decoder resynchronises and the trailer
+    // is checked at the end.
+    in->size -= TRAILER_SIZE;
+    if (!quiet)
+      fprintf(stderr, "The archive is %zu bytes %s than expected.\n",
+        (sz) llabs((long long) in->size
+                 - (long long) (tr->laces * lace_size)),
+        in->size > tr->laces * lace_size ? "longer" : "shorter");
+    return 1;
+  }
+  if (!quiet)
+    fprintf(stderr, "Truncated file: %zu laces and %zu stray bytes.\n",
+      in->size / lace_size, rest);
+  if (!force) exit(1);
+  return -1;
+}
+// Laces are located in order, a batch at a time, then decoded in parallel,
+// each into a buffer of its own, and written out in order. Only laces that
+// were spliced or cut short are copied out of the mapping. Nothing is
+// reported until a lace is written, so the messages come out in order: a
+// lace with blocks lost is decoded once more then, to report them.
+#define DECODE_BATCH 256
+typedef struct {
+  u8 * at, * copy, * out, * found, * expected, h[BLOCK_HDR_SIZE];
+  sz n, size;  bool short_hdr, shifted, past, zero;  int ecc, lost;  u32 crc;
+} dlace_t;
+typedef struct {
+  u8 * body, * end, * pos;  int ifactor;  bool has_trailer, force, quiet;
+  trailer_t tr;  sz base, batch;  dlace_t ls[DECODE_BATCH];
+  u8 * out, * in2, * spl, * buf;  xpipe_t * zc;  cache_t ci, co;
+  FILE * f;  sz pending;  trailer_t chk;  int ecc;
+  ckpt_t * ck;  replica_t * rep;
+} decode_batch_t;
+static sz decode_locate(decode_batch_t * d) {
+  int ifactor = d->ifactor;  sz ibs = compute_interlacing_bs(ifactor), i;
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;  u8 pat[4];
+  for (i = 0; i < d->batch && d->pos < d->end; i++) {
+    dlace_t * x = &d->ls[i];  sz l = d->base + i, avail = d->end - d->pos, h;
+    u8 * p = d->pos, * e = p + ibs * N, * hp = e;
+    memset(x, 0, sizeof(dlace_t));
+    x->at = p, x->n = MIN(avail, ibs * N);
+    x->out = d->zc ? xpipe_buffer(d->zc) : d->out + i * ibs * K;
+    block_pattern(pat, d->has_trailer && l < d->tr.laces
+                  ? MIN(ibs * K, d->tr.size - l * ibs * K) : ibs * K);
+    if (x->n < ibs * N) {
+      x->at = x->copy = xlace_alloc(ibs * N);
+      memcpy(x->copy, p, x->n);  memset(x->copy + x->n, 0, ibs * N - x->n);
+      hp = d->end;
+    } else if (!hdr_at(e, d->end - e, pat)) {
+      u8 * ws = e - MIN(lace_size, (sz) (e - d->body));
+      u8 * we = e + MIN((sz) (d->end - e), 2 * lace_size + 4);
+      if (find_shift(ws, we - ws, e - ws, pat, ibs, we == d->end, &h)) {
+        if (!d->spl) d->spl = xlace_alloc(ibs * N), d->buf = xlace_alloc(ibs * K);
+        if (!d->in2) d->in2 = xlace_alloc(ibs * N);
+        hp = ws + h;  x->shifted = true, x->found = hp, x->expected = e;
+        if (!trial_lace(p, hp, d->in2, d->buf, ifactor)) {
+          u8 * c = x->at = x->copy = xlace_alloc(ibs * N);
+          memcpy(c, p, ibs * N);
+          splice_lace(c, hp, hp - d->body, d->spl, d->in2, d->buf, ifactor);
         }
-      } else ecc += n;
-      memcpy(out_buffer + i * K, in2 + i * N, K);
-    )
-    sz size = MIN(ibs * K, bhdr.bytes);
-    u32 crc = crc32c(out_buffer, size);
-    if (crc != bhdr.crc) {
+      }
+    }
+    sz hn = MIN(BLOCK_HDR_SIZE, (sz) (d->end - hp));
+    memcpy(x->h, hp, hn);  x->short_hdr = hn < BLOCK_HDR_SIZE;
+    d->pos = hp + hn;
+    // Invalid block headers are reported when the lace is written.
+    block_hdr b = { 0xFFFFFF, 0 };
+    if (x->h[0] == 'X') b = parse_block_header(x->h, true);
+    x->size = d->has_trailer ? trailer_bytes(d->tr, ibs, l) : b.bytes;
+    if ((x->past = x->size == (sz) -1)) x->size = b.bytes;
+    x->size = MIN(ibs * K, x->size);
+    cache_read(&d->ci, HEADER_SIZE + (d->pos - d->body));
+  }
+  return i;
+}
+static void decode_lace(decode_batch_t * d, sz i, u8 * in2, bool report) {
+  dlace_t * x = &d->ls[i];  sz ibs = compute_interlacing_bs(d->ifactor);
+  if ((x->zero = is_zero(x->at, ibs * N))) {
+    x->crc = zero_crc(x->size);
+    return;
+  }
+  do_interlacing(x->at, in2, d->ifactor);
+  rsd_job_t j = { .cw = in2, .out = x->out, .report = report,
+                  .quiet = d->quiet, .force = d->force, .lace = d->base + i,
+                  .bytes = x->size };
+  rsd_lace(&j, d->ifactor);  x->ecc = j.ecc, x->lost = j.lost, x->crc = j.crc;
+}
+static void decode_range(void * ctx, sz lo, sz hi) {
+  decode_batch_t * d = ctx;  sz ibs = compute_interlacing_bs(d->ifactor);
+  u8 * in2 = xlace_alloc(ibs * N);
+  for (sz i = lo; i < hi; i++) decode_lace(d, i, in2, false);
+  xlace_free(in2);
+}
+static void decode_done(void * ctx, sz i) {
+  decode_batch_t * d = ctx;  dlace_t * x = &d->ls[i];
+  int ifactor = d->ifactor, force = d->force;  bool quiet = d->quiet;
+  sz ibs = compute_interlacing_bs(ifactor), size = x->size;
+  unsigned laces = d->base + i;
+  if (x->n < ibs * N) {
+    if (!quiet)
+      fprintf(stderr, "Short read, lace %u (bytes %zu-%zu).\n",
+        laces, laces * ibs * N, laces * ibs * N + x->n - 1);
+    if (!force) exit(1);
+  }
+  if (x->shifted) report_shift(laces, x->found, x->expected, quiet);
+  if (x->short_hdr) {
+    if (!quiet)
+      fprintf(stderr,
+        "Short read (block header), lace %u (bytes %zu-%zu).\n",
+        laces, laces * ibs * N, laces * ibs * N + x->n - 1);
+    if (!force) exit(1);
+  }
+  block_hdr bhdr = parse_block_header(x->h, force);
+  if (x->past) {
+    if (!quiet)
+      fprintf(stderr, "Trailer mismatch: lace %u is past the %llu laces "
+        "recorded.\n", laces, (unsigned long long) d->tr.laces);
+    if (!force) exit(1);
+  }
+  if (x->lost && !d->rep) {
+    if (!d->in2) d->in2 = xlace_alloc(ibs * N);
+    decode_lace(d, i, d->in2, true);
+  }
+  bool zero = x->zero;  u32 crc = x->crc;  d->ecc += x->ecc;
+  if ((x->lost || crc != bhdr.crc) && d->rep) {
+    if (replica_lace(d->rep, laces, ifactor, x->at, &bhdr, size, x->out, &crc))
+      zero = false;
+    else if (x->lost) {
       if (!quiet)
-        fprintf(stderr, "CRC mismatch, block %zu (lace %u, bytes %zu-%zu).\n",
-          laces * ibs, laces, laces * ibs * N, laces * ibs * N + size - 1);
+        fprintf(stderr, "Lace %u: %d blocks irrecoverable in both copies.\n",
+          laces, x->lost);
       if (!force) exit(1);
     }
-    xfwrite(out_buffer, size, out);
   }
-  free(in1), free(in2), free(out_buffer); xfclose(out);
+  if (crc != bhdr.crc) {
+    if (!quiet)
+      fprintf(stderr, "CRC mismatch, block %zu (lace %u, bytes %zu-%zu).\n",
+        laces * ibs, laces, laces * ibs * N, laces * ibs * N + size - 1);
+    if (!force) exit(1);
+  }
+  if (zero) d->pending += size;
+  else {
+    put_zeros(d->f, d->pending), d->pending = 0;
+    if (d->zc) xpipe_write(d->zc, size); else xfwrite(x->out, size, d->f);
+  }
+  trailer_add_lace(&d->chk, (block_hdr) { size, crc });
+  cache_write(&d->co, d->chk.size - d->pending);
+  if (ckpt_due(d->ck)) {
+    put_zeros(d->f, d->pending), d->pending = 0;
+    write_ckpt(d->ck, d->f, d->chk, d->ecc);
+  }
+  xlace_free(x->copy);
+}
+static void decode3(mmap_t in, FILE * probe, FILE * out, int force,
+                    int ifactor_override, bool quiet, bool verbose,
+                    ckpt_t * ck, replica_t * rep) {
+  int ifactor = read_header_from_map(in, force, ifactor_override);
+  if (rep) check_replica(rep, ifactor, force);
+  in.size -= HEADER_SIZE; in.map += HEADER_SIZE; // Skip the header.
+  sz ibs = compute_interlacing_bs(ifactor);
+  trailer_t tr;
+  bool has_trailer = map_trailer(&in, ifactor, ibs, &tr, force, quiet) > 0;
+  // Preallocating would fill the holes left in the output for zero laces.
+  sz data, hole;  xdata_extent(probe, 0, &data, &hole);
+  if (has_trailer && !data && hole >= in.size) xpreallocate(out, tr.size);
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  decode_batch_t d = { .body = in.map, .end = in.map + in.size, .pos = in.map,
+                       .ifactor = ifactor, .has_trailer = has_trailer,
+                       .force = force, .quiet = quiet, .tr = tr, .f = out,
+                       .ck = ck, .rep = rep };
+  if (ck) {
+    d.pos += MIN(in.size, ck->tr.laces * lace_size);
+    d.chk = ck->tr, d.base = d.chk.laces, d.ecc = ck->ecc;
+    ck->ifactor = ifactor;
+  }
+  d.ci = cache_init(probe, d.body, HEADER_SIZE, in.size);
+  d.co = cache_out(out, d.chk.size, ibs * K);
+  // A lace of the largest factor is already decoded by all the threads, so
+  // it goes alone, straight into the buffer handed to the pipe if any.
+  d.batch = ifactor == 3 ? 1 : DECODE_BATCH;
+  if (ifactor == 3) d.zc = xpipe_open(out, ibs * K);
+  if (!d.zc) d.out = xlace_alloc(d.batch * ibs * K);
+  for (sz n; (n = decode_locate(&d)); d.base += n)
+    pool_ordered(n, 1, decode_range, decode_done, &d);
+  put_zeros(out, d.pending);
+  if (has_trailer) check_trailer(tr, d.chk, force, quiet);
+  if (rep && !quiet && verbose)
+    fprintf(stderr, "Recovered %llu laces from the replica "
+      "(%llu bytes read).\n", (unsigned long long) rep->recovered,
+      (unsigned long long) rep->read);
+  xlace_free(d.out), xlace_free(d.in2), xlace_free(d.spl), xlace_free(d.buf);
+  xpipe_close(d.zc);
+  xfclose(out);
   if (!quiet && verbose)
-    fprintf(stderr, "Decoded %u laces, %u errors corrected.\n", laces, ecc);
+    fprintf(stderr, "Decoded %u laces, %u errors corrected.\n",
+      (unsigned) d.base, d.ecc);
+}
+#endif
+
+// ============================================================================
+//  Verification (scrubbing). Nothing is written: every lace is de-interlaced,
+//  the syndromes of its codewords are computed (the rest of the decoder only
+//  runs when they are non-zero) and the CRC is taken straight from the data
+//  part of the codewords. Mapped archives are verified in parallel, in batches
+//  of laces, and every lace is reported in order as soon as all the laces
+//  before it are verified. Laces shifted by inserted or deleted bytes are
+//  found and spliced as when decoding, and count as degraded.
+// ============================================================================
+typedef struct {
+  int ecc, lost; bool bad_header, bad_crc, shifted; u32 crc; sz bytes;
+} health_t;
+static health_t scrub_lace(u8 * lace, u8 * hdr, u8 * in2, int ifactor,
+                           sz bytes) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  health_t h;  memset(&h, 0, sizeof(health_t));
+  block_hdr bhdr = { 0, 0 };
+  if (hdr && hdr[0] == 'X') bhdr = parse_block_header(hdr, true);
+  if (bhdr.bytes > ibs * K || (bytes != (sz) -1 && bhdr.bytes != bytes))
+    h.bad_header = true;
+  if (bytes == (sz) -1) bytes = h.bad_header ? ibs * K : bhdr.bytes;
+  h.bytes = bytes;
+  rsd_job_t j = { .cw = in2, .bytes = bytes };
+  if (is_zero(lace, ibs * N)) h.crc = zero_crc(bytes);
+  else {
+    do_interlacing(lace, in2, ifactor);
+    rsd_lace(&j, ifactor);  h.crc = j.crc;
+  }
+  h.ecc = j.ecc; h.lost = j.lost;
+  h.bad_crc = !h.bad_header && h.crc != bhdr.crc;
+  return h;
+}
+typedef struct { u64 laces, clean, degraded, damaged, ecc; } scrub_stats_t;
+static void report_lace(scrub_stats_t * st, health_t h, bool quiet,
+                        bool verbose) {
+  sz lace = st->laces++;  st->ecc += h.ecc;
+  if (h.lost || h.bad_crc || h.bad_header) {
+    st->damaged++;
+    if (!quiet)
+      printf("Lace %zu: damaged (%d errors corrected, %d blocks "
+        "irrecoverable%s%s).\n", lace, h.ecc, h.lost,
+        h.bad_header ? ", invalid block header" : "",
+        h.bad_crc ? ", CRC mismatch" : "");
+  } else if (h.ecc || h.shifted) {
+    st->degraded++;
+    if (!quiet) printf("Lace %zu: degraded (%d errors corrected%s).\n",
+      lace, h.ecc, h.shifted ? ", resynchronised" : "");
+  } else {
+    st->clean++;
+    if (verbose) printf("Lace %zu: OK.\n", lace);
+  }
+}
+// The lace CRCs are only known when no lace is damaged, so the checksum
+// chain is not compared otherwise: a damaged lace is reported as such, not
+// as a mismatching trailer.
+static bool trailer_mismatch(trailer_t tr, trailer_t chk, scrub_stats_t st) {
+  return tr.laces != chk.laces || (!st.damaged && tr.chain != chk.chain);
+}
+// A trailer that decodes but disagrees with intact laces can not be
+// repaired, unlike a damaged one.
+static int scrub_summary(scrub_stats_t st, bool bad_trailer, bool mismatch,
+                         bool quiet) {
+  if (!quiet)
+    printf("%llu laces: %llu clean, %llu degraded, %llu damaged; "
+      "%llu errors correctable%s%s.\n",
+      (unsigned long long) st.laces, (unsigned long long) st.clean,
+      (unsigned long long) st.degraded, (unsigned long long) st.damaged,
+      (unsigned long long) st.ecc, bad_trailer ? "; trailer damaged" : "",
+      mismatch ? "; trailer does not match the laces" : "");
+  if (st.damaged || mismatch) return 1;
+  return st.degraded || bad_trailer ? 2 : 0;
+}
+static int test4(FILE * in, int ifactor_override, bool quiet, bool verbose) {
+  notty(in);
+  int ifactor = read_header(in, true, ifactor_override);
+  sz ibs = compute_interlacing_bs(ifactor);
+  u8 * in1 = xlace_alloc(ibs * N), * in2 = xlace_alloc(ibs * N), tmp[8];
+  u8 pat[4], prev[8], * spl = NULL, * buf = NULL;  sz back = 0;
+  trailer_t tr, chk = { 0 }, expect;  carry_t c = { in, NULL, 0, 0 };
+  bool has_trailer = false, bad_trailer = false, expected = false;
+  scrub_stats_t st = { 0 };
+  for (sz n; n = carry_read(&c, in1, ibs * N); ) {
+    if (n == TRAILER_SIZE) {
+      has_trailer = unpack_trailer(in1, ifactor, &tr);
+      bad_trailer = !has_trailer;  break;
+    }
+    if (n < ibs * N) memset(in1 + n, 0, ibs * N - n);
+    sz hn = carry_read(&c, tmp, 8), at;
+    bool short_hdr = hn != 8, shifted = false;
+    block_pattern(pat, !expected ? ibs * K : chk.laces < expect.laces
+                  ? MIN(ibs * K, expect.size - chk.laces * ibs * K) : ibs * K);
+    if (n == ibs * N && !hdr_at(tmp, hn, pat)
+     && stream_shift(&c, prev, back, in1, tmp, hn, ifactor, chk.laces, &expect,
+                     &expected, &at)) {
+      if (!spl) spl = xlace_alloc(ibs * N), buf = xlace_alloc(ibs * K);
+      report_shift(chk.laces, c.win + at, c.win + back + n, quiet);
+      if (!trial_lace(in1, c.win + at, in2, buf, ifactor))
+        splice_lace(in1, c.win + at, at, spl, in2, buf, ifactor);
+      memcpy(tmp, c.win + at, 8);
+      short_hdr = false, shifted = true;
+    }
+    memcpy(prev, tmp, 8), back = 8;
+    health_t h = scrub_lace(in1, short_hdr ? NULL : tmp, in2, ifactor, -1);
+    if (n < ibs * N) h.lost = h.lost ? h.lost : 1;
+    h.shifted = shifted;
+    trailer_add_lace(&chk, (block_hdr) { 0, h.crc });
+    report_lace(&st, h, quiet, verbose);
+  }
+  bool mismatch = has_trailer && trailer_mismatch(tr, chk, st);
+  xlace_free(in1), xlace_free(in2), xlace_free(spl), xlace_free(buf);
+  free(c.win);
+  return scrub_summary(st, bad_trailer, mismatch, quiet);
+}
+#ifdef XPAR_ALLOW_MAPPING
+#define SCRUB_BATCH 256
+// Laces are located in order, a batch at a time, before they are scrubbed in
+// parallel. `at' is where each lace starts and `hdr' its block header if it
+// was found elsewhere than right after the lace; such laces are spliced and
+// scrubbed while they are located.
+typedef struct {
+  mmap_t in;  int ifactor;  bool has_trailer;  trailer_t tr;  sz base;
+  health_t hs[SCRUB_BATCH];  u8 * at[SCRUB_BATCH], * hdr[SCRUB_BATCH], * pos;
+  u8 * in1, * in2, * spl, * buf;
+  trailer_t chk;  scrub_stats_t st;  bool quiet, verbose;
+} test_batch_t;
+static sz test_locate(test_batch_t * t) {
+  int ifactor = t->ifactor;  sz ibs = compute_interlacing_bs(ifactor), i;
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  u8 * body = t->in.map, * end = body + t->in.size, pat[4];
+  for (i = 0; i < SCRUB_BATCH && t->pos < end; i++) {
+    sz l = t->base + i, avail = end - t->pos, h;
+    u8 * p = t->pos, * e = p + ibs * N;
+    t->at[i] = p, t->hdr[i] = NULL;
+    t->pos = p + MIN(avail, lace_size);
+    block_pattern(pat, t->has_trailer && l < t->tr.laces
+                  ? MIN(ibs * K, t->tr.size - l * ibs * K) : ibs * K);
+    if (avail < ibs * N || hdr_at(e, end - e, pat)) continue;
+    u8 * ws = e - MIN(lace_size, (sz) (e - body));
+    u8 * we = e + MIN((sz) (end - e), 2 * lace_size + 4);
+    if (!find_shift(ws, we - ws, e - ws, pat, ibs, we == end, &h)) continue;
+    if (!t->in1)
+      t->in1 = xlace_alloc(ibs * N), t->in2 = xlace_alloc(ibs * N),
+      t->spl = xlace_alloc(ibs * N), t->buf = xlace_alloc(ibs * K);
+    u8 * hp = ws + h;  memcpy(t->in1, p, ibs * N);
+    if (!trial_lace(t->in1, hp, t->in2, t->buf, ifactor))
+      splice_lace(t->in1, hp, hp - body, t->spl, t->in2, t->buf, ifactor);
+    t->hs[i] = scrub_lace(t->in1, hp, t->in2, ifactor, t->has_trailer
+                          ? trailer_bytes(t->tr, ibs, l) : (sz) -1);
+    t->hs[i].shifted = true;
+    t->hdr[i] = hp, t->pos = MIN(hp + BLOCK_HDR_SIZE, end);
+  }
+  return i;
+}
+static void test_range(void * ctx, sz lo, sz hi) {
+  test_batch_t * t = ctx;  int ifactor = t->ifactor;
+  sz ibs = compute_interlacing_bs(ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  u8 * in1 = xlace_alloc(ibs * N), * in2 = xlace_alloc(ibs * N);
+  for (sz i = lo; i < hi; i++) {
+    if (t->hdr[i]) continue;
+    sz l = t->base + i, avail = t->in.map + t->in.size - t->at[i];
+    u8 * lace = t->at[i];
+    sz bytes = t->has_trailer ? trailer_bytes(t->tr, ibs, l) : (sz) -1;
+    if (avail < lace_size) {
+      // Truncated lace: scrub what is there, it is lost regardless.
+      sz n = MIN(ibs * N, avail);
+      memcpy(in1, lace, n);  memset(in1 + n, 0, ibs * N - n);
+      t->hs[i] = scrub_lace(in1, NULL, in2, ifactor, bytes);
+      t->hs[i].lost = t->hs[i].lost ? t->hs[i].lost : 1;
+    } else
+      t->hs[i] = scrub_lace(lace, lace + ibs * N, in2, ifactor, bytes);
+  }
+  xlace_free(in1), xlace_free(in2);
+}
+static void test_done(void * ctx, sz i) {
+  test_batch_t * t = ctx;
+  sz ibs = compute_interlacing_bs(t->ifactor);
+  if (t->hdr[i])
+    report_shift(t->base + i, t->hdr[i], t->at[i] + ibs * N, t->quiet);
+  trailer_add_lace(&t->chk, (block_hdr) { 0, t->hs[i].crc });
+  report_lace(&t->st, t->hs[i], t->quiet, t->verbose);
+}
+static int test3(mmap_t in, int ifactor_override, bool quiet, bool verbose) {
+  int ifactor = read_header_from_map(in, true, ifactor_override);
+  in.size -= HEADER_SIZE; in.map += HEADER_SIZE;
+  sz ibs = compute_interlacing_bs(ifactor);
+  trailer_t tr = { 0 };
+  int found = map_trailer(&in, ifactor, ibs, &tr, true, quiet);
+  bool has_trailer = found > 0, bad_trailer = found < 0;
+  test_batch_t t = { in, ifactor, has_trailer, tr, .pos = in.map,
+                     .quiet = quiet, .verbose = verbose };
+  for (sz n; (n = test_locate(&t)); t.base += n)
+    pool_ordered(n, ifactor == 3 ? SCRUB_BATCH : 1, test_range, test_done, &t);
+  xlace_free(t.in1), xlace_free(t.in2), xlace_free(t.spl), xlace_free(t.buf);
+  bool mismatch = has_trailer && trailer_mismatch(tr, t.chk, t.st);
+  return scrub_summary(t.st, bad_trailer, mismatch, quiet);
 }
 #endif
 
@@ -432,39 +1396,1118 @@ static FILE * open_output(joint_options_t o) {
   }
   return out;
 }
+// ============================================================================
+//  Appending. The trailer keeps the lace CRC chain both with and without the
+//  last lace, so a partial last lace can be dropped and encoded again along
+//  with the new data, without reading the rest of the archive.
+// ============================================================================
+// Opens an existing archive for modification, returns its interlacing factor.
+static int open_existing(joint_options_t o, FILE ** out, sz * size) {
+  if (!o.input_name || !o.output_name)
+    FATAL("Updating an archive requires named input and output files.");
+  struct stat st = validate_file(o.output_name);
+  if (!(*out = fopen(o.output_name, "r+b"))) FATAL_PERROR("fopen");
+  if (st.st_size < HEADER_SIZE) FATAL("Truncated file.");
+  *size = st.st_size;
+  return read_header(*out, o.force, o.interlacing);
+}
+static void append_encode(joint_options_t o) {
+  FILE * out, * in = NULL;  sz size;
+  int ifactor = open_existing(o, &out, &size);
+  struct stat ist = validate_file(o.input_name);
+  sz ibs = compute_interlacing_bs(ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  sz body = size - HEADER_SIZE;  trailer_t tr;
+  if (body % lace_size != TRAILER_SIZE)
+    FATAL("The archive has no trailer, can not append.");
+  if (!read_trailer(out, size - TRAILER_SIZE, ifactor, &tr)
+   || !trailer_consistent(tr, ibs) || tr.laces != body / lace_size)
+    FATAL("Invalid trailer, can not append. Try repairing the archive.");
+  if ((u64) ist.st_size < tr.size)
+    FATAL("The input is smaller than the archived data.");
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t map = { NULL, 0 };
+  if (!o.no_map) map = xpar_map(o.input_name);
+  if (!map.map)
+  #endif
+    if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+  // The last lace is encoded again, so check it against the input first.
+  trailer_t resume = tr;
+  if (tr.laces) {
+    sz last = tr.size - (tr.laces - 1) * ibs * K;  u8 h[8];
+    xfseek(out, HEADER_SIZE + tr.laces * lace_size - BLOCK_HDR_SIZE);
+    if (xfread(h, 8, out) != 8) FATAL("Short read.");
+    block_hdr bhdr = parse_block_header(h, o.force);
+    u8 * buf = xmalloc(last);
+    #if defined(XPAR_ALLOW_MAPPING)
+    if (map.map) memcpy(buf, map.map + tr.size - last, last); else
+    #endif
+    {
+      xfseek(in, tr.size - last);
+      if (xfread(buf, last, in) != last) FATAL("Short read.");
+    }
+    if (crc32c(buf, last) != bhdr.crc)
+      FATAL_UNLESS("The input does not extend the archive.", !o.force);
+    free(buf);
+    if (last < ibs * K)
+      resume.laces--, resume.size -= last, resume.chain = tr.chain_prev;
+  }
+  if (!o.quiet && o.verbose)
+    fprintf(stderr, "Appending %llu bytes after lace %llu.\n",
+      (unsigned long long) (ist.st_size - resume.size),
+      (unsigned long long) resume.laces);
+  // Zero laces are skipped over, so nothing may be left past the new data.
+  xftruncate(out, HEADER_SIZE + resume.laces * lace_size);
+  xfseek(out, HEADER_SIZE + resume.laces * lace_size);
+  #if defined(XPAR_ALLOW_MAPPING)
+  if (map.map) {
+    mmap_t rest = { map.map + resume.size, map.size - resume.size };
+    encode3(rest, NULL, out, ifactor, &resume, NULL);
+    xpar_unmap(&map);
+    return;
+  }
+  #endif
+  xfseek(in, resume.size);
+  encode4(in, out, ifactor, &resume, NULL);
+  fclose(in);
+}
+// ============================================================================
+//  Updating. Laces are independent, so only the laces whose data changed
+//  need to be encoded again: the CRC of every lace of the new input is
+//  compared with the one in the corresponding block header of the archive,
+//  and only mismatching laces are rewritten in place.
+// ============================================================================
+static void update_encode(joint_options_t o) {
+  FILE * out, * in = NULL;  sz size;
+  int ifactor = open_existing(o, &out, &size);
+  validate_file(o.input_name);
+  sz ibs = compute_interlacing_bs(ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  sz body = size - HEADER_SIZE, old_laces = body / lace_size;
+  if (body % lace_size && body % lace_size != TRAILER_SIZE)
+    FATAL_UNLESS("Truncated file.", !o.force);
+  u8 * in_buffer = xlace_alloc(ibs * K), * o1 = xlace_alloc(ibs * N),
+     * o2 = xlace_alloc(ibs * N), * chunk, h[8];
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t map = { NULL, 0 }, arc = { NULL, 0 };
+  if (!o.no_map) map = xpar_map(o.input_name), arc = xpar_map(o.output_name);
+  sz left = map.size;
+  if (!map.map)
+  #endif
+    if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+  trailer_t tr = { 0 };  u64 changed = 0;
+  for (sz l = 0, n; ; l++) {
+    #if defined(XPAR_ALLOW_MAPPING)
+    if (map.map)
+      chunk = map.map + l * ibs * K, n = MIN(left, ibs * K), left -= n;
+    else
+    #endif
+      chunk = in_buffer, n = xfread(in_buffer, ibs * K, in);
+    if (!n) break;
+    block_hdr bhdr = { n, crc32c(chunk, n) };
+    if (l < old_laces) {
+      sz off = HEADER_SIZE + l * lace_size + ibs * N;
+      #if defined(XPAR_ALLOW_MAPPING)
+      if (arc.map) memcpy(h, arc.map + off, 8); else
+      #endif
+      { xfseek(out, off); xfread(h, 8, out); }
+      block_hdr old = parse_block_header(h, true);
+      if (h[0] == 'X' && old.bytes == bhdr.bytes && old.crc == bhdr.crc) {
+        trailer_add_lace(&tr, bhdr);
+        continue;
+      }
+    }
+    xfseek(out, HEADER_SIZE + l * lace_size);
+    if (is_zero(chunk, n)) bhdr = zero_lace(out, n, ifactor);
+    else {
+      if (chunk != in_buffer) memcpy(in_buffer, chunk, n);
+      bhdr = encode_lace(in_buffer, n, o1, o2, ifactor);
+      xfwrite(o2, ibs * N, out);
+    }
+    write_block_header(out, bhdr);  trailer_add_lace(&tr, bhdr);
+    changed++;
+  }
+  // Laces past the end of the new input go along with the old trailer.
+  xftruncate(out, HEADER_SIZE + tr.laces * lace_size);
+  xfseek(out, HEADER_SIZE + tr.laces * lace_size);
+  write_trailer(out, tr, ifactor);
+  #if defined(XPAR_ALLOW_MAPPING)
+  xpar_unmap(&map);  xpar_unmap(&arc);
+  #endif
+  if (in) fclose(in);
+  xlace_free(in_buffer), xlace_free(o1), xlace_free(o2);  xfclose(out);
+  if (!o.quiet && o.verbose)
+    fprintf(stderr, "Rewrote %llu of %llu laces.\n",
+      (unsigned long long) changed, (unsigned long long) tr.laces);
+}
+// ============================================================================
+//  Resuming from a checkpoint. The laces written before the checkpoint are
+//  validated first: when encoding, their block headers must be intact, and
+//  when decoding, the output must match the CRCs in the block headers of the
+//  archive. Work continues after the last valid lace.
+// ============================================================================
+static ckpt_t * open_ckpt(joint_options_t o, u8 mode, ckpt_t * c) {
+  if (!o.resume) return NULL;
+  if (!o.input_name || !o.output_name)
+    FATAL("Resuming requires named input and output files.");
+  struct stat st = validate_file(o.input_name);
+  memset(c, 0, sizeof(ckpt_t));
+  c->mode = mode;  c->ifactor = o.interlacing;  c->last = time(NULL);
+  c->isize = st.st_size;  c->imtime = st.st_mtime;
+  if (asprintf(&c->name, "%s.ckpt", o.output_name) == -1)
+    FATAL_PERROR("asprintf");
+  return c;
+}
+static void close_ckpt(ckpt_t * c) {
+  if (!c) return;
+  if (remove(c->name) && errno != ENOENT) FATAL_PERROR("remove");
+  free(c->name);
+}
+static FILE * resume_encoding(joint_options_t o, ckpt_t * c) {
+  FILE * out;  sz size;  u8 h[8];  trailer_t tr = { 0 };
+  if (open_existing(o, &out, &size) != c->ifactor)
+    FATAL("The output does not match the checkpoint.");
+  sz ibs = compute_interlacing_bs(c->ifactor);
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t arc = { NULL, 0 };
+  if (!o.no_map) arc = xpar_map(o.output_name);
+  #endif
+  while (tr.laces < c->tr.laces) {
+    sz off = HEADER_SIZE + tr.laces * lace_size + ibs * N;
+    if (off + BLOCK_HDR_SIZE > size) break;
+    #if defined(XPAR_ALLOW_MAPPING)
+    if (arc.map) memcpy(h, arc.map + off, 8); else
+    #endif
+    { xfseek(out, off);  xfread(h, 8, out); }
+    block_hdr bhdr = parse_block_header(h, true);
+    if (h[0] != 'X' || bhdr.bytes != ibs * K) break;
+    trailer_add_lace(&tr, bhdr);
+  }
+  #if defined(XPAR_ALLOW_MAPPING)
+  xpar_unmap(&arc);
+  #endif
+  // The CRC chain catches block headers damaged in a plausible way.
+  if (tr.laces == c->tr.laces && tr.chain != c->tr.chain)
+    memset(&tr, 0, sizeof(trailer_t));
+  c->tr = tr;
+  xftruncate(out, HEADER_SIZE + tr.laces * lace_size);
+  xfseek(out, HEADER_SIZE + tr.laces * lace_size);
+  return out;
+}
+static FILE * resume_decoding(joint_options_t o, ckpt_t * c) {
+  FILE * out, * in;  u8 h[8];  trailer_t tr = { 0 };
+  if (!(out = fopen(o.output_name, "r+b"))) FATAL_PERROR("fopen");
+  if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+  if (read_header(in, o.force, o.interlacing) != c->ifactor)
+    FATAL("The input does not match the checkpoint.");
+  sz ibs = compute_interlacing_bs(c->ifactor);
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  u8 * buf = xmalloc(ibs * K);
+  while (tr.laces < c->tr.laces) {
+    xfseek(in, HEADER_SIZE + tr.laces * lace_size + ibs * N);
+    if (xfread(h, 8, in) != 8) break;
+    block_hdr bhdr = parse_block_header(h, true);
+    if (h[0] != 'X' || bhdr.bytes != ibs * K) break;
+    xfseek(out, tr.size);
+    if (xfread(buf, ibs * K, out) != ibs * K) break;
+    if (crc32c(buf, ibs * K) != bhdr.crc) break;
+    trailer_add_lace(&tr, bhdr);
+  }
+  free(buf);  fclose(in);
+  c->tr = tr;
+  xftruncate(out, tr.size);  xfseek(out, tr.size);
+  return out;
+}
 void do_joint_encode(joint_options_t o) {
-  FILE * out = open_output(o), * in = stdin;
+  if (o.append) { append_encode(o); return; }
+  if (o.update) { update_encode(o); return; }
+  ckpt_t c, * ck = open_ckpt(o, 'e', &c);
+  FILE * out, * in = stdin;  trailer_t * resume = NULL;
+  if (ck && read_ckpt(ck)) out = resume_encoding(o, ck), resume = &ck->tr;
+  else out = open_output(o);
+  int ifactor = ck ? ck->ifactor : o.interlacing;
+  if (resume && !o.quiet && o.verbose)
+    fprintf(stderr, "Resuming after lace %llu.\n",
+      (unsigned long long) resume->laces);
   if (o.input_name) {
     struct stat st = validate_file(o.input_name);
     if(!o.no_map) {
       #if defined(XPAR_ALLOW_MAPPING)
       mmap_t map = xpar_map(o.input_name);
       if (map.map) {
-        encode3(map, out, o.interlacing);
-        xpar_unmap(&map);
+        // Hole detection works on file offsets, so is only done from the start.
+        FILE * probe = resume ? NULL : fopen(o.input_name, "rb");
+        sz skip = resume ? MIN(map.size, resume->size) : 0;
+        mmap_t rest = { map.map + skip, map.size - skip };
+        encode3(rest, probe, out, ifactor, resume, ck);
+        xpar_unmap(&map);  if (probe) fclose(probe);
+        close_ckpt(ck);
         return;
       }
       #endif
     }
     if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+    if (resume) xfseek(in, resume->size);
   }
-  encode4(in, out, o.interlacing);
+  encode4(in, out, ifactor, resume, ck);
+  close_ckpt(ck);
 }
 void do_joint_decode(joint_options_t o) {
-  FILE * out = open_output(o), * in = stdin;
+  ckpt_t c, * ck = open_ckpt(o, 'd', &c);
+  replica_t r = { NULL, 0, 0 }, * rep = NULL;
+  FILE * out, * in = stdin;
+  if (o.replica) {
+    validate_file(o.replica);
+    if (!(r.f = fopen(o.replica, "rb"))) FATAL_PERROR("fopen");
+    rep = &r;
+  }
+  if (ck && read_ckpt(ck)) out = resume_decoding(o, ck);
+  else out = open_output(o);
+  if (ck && ck->tr.laces && !o.quiet && o.verbose)
+    fprintf(stderr, "Resuming after lace %llu.\n",
+      (unsigned long long) ck->tr.laces);
   if (o.input_name) {
     struct stat st = validate_file(o.input_name);
     if(!o.no_map) {
       #if defined(XPAR_ALLOW_MAPPING)
       mmap_t map = xpar_map(o.input_name);
       if (map.map) {
-        decode3(map, out, o.force, o.interlacing, o.quiet, o.verbose);
-        xpar_unmap(&map);
+        FILE * probe = fopen(o.input_name, "rb");
+        decode3(map, probe, out, o.force, o.interlacing, o.quiet, o.verbose,
+                ck, rep);
+        xpar_unmap(&map);  if (probe) fclose(probe);
+        if (rep) fclose(rep->f);
+        close_ckpt(ck);
         return;
       }
       #endif
     }
     if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
   }
-  decode4(in, out, o.force, o.interlacing, o.quiet, o.verbose);
+  decode4(in, out, o.force, o.interlacing, o.quiet, o.verbose, ck, rep);
+  if (rep) fclose(rep->f);
+  close_ckpt(ck);
+}
+// ============================================================================
+//  Batch mode. Many files are encoded by one process, which shares the
+//  tables, the lace buffers and the threads between them. Below -i 3 a lace
+//  is encoded by a single thread, so files are encoded several at a time
+//  instead. The archives are synchronised together once all are written.
+// ============================================================================
+typedef struct {
+  joint_options_t o;  char ** names, ** outs;  const char ** status;
+  int failed;
+} batch_t;
+static void batch_range(void * ctx, sz lo, sz hi) {
+  batch_t * b = ctx;  int failed = 0;
+  for (sz i = lo; i < hi; i++) {
+    joint_options_t f = b->o;  struct stat st;  FILE * t;
+    char * name = b->names[i], ** out = &b->outs[i];
+    if (asprintf(out, "%s.xpa", name) == -1) FATAL_PERROR("asprintf");
+    f.input_name = name, f.output_name = *out;
+    // The usual checks are fatal, so they are done here first.
+    if (stat(name, &st) == -1 || !(t = fopen(name, "rb")))
+      b->status[i] = "can not be read";
+    else if (fclose(t), !S_ISREG(st.st_mode))
+      b->status[i] = "is not a regular file";
+    else if (!f.force && !stat(*out, &st) && st.st_size)
+      b->status[i] = "skipped, the archive exists";
+    else {
+      do_joint_encode(f);  b->status[i] = NULL;
+      continue;
+    }
+    failed++;
+  }
+  pool_add(&b->failed, failed);
+}
+int do_joint_batch(joint_options_t o, char ** names, int n) {
+  char ** outs = xmalloc(n * sizeof(char *));
+  const char ** status = xmalloc(n * sizeof(char *));
+  int sync = xset_sync(SYNC_NONE), failed, done = 0;
+  batch_t b = { o, names, outs, status, 0 };
+  pool_for(n, o.interlacing < 3 ? 1 : n, batch_range, &b);  failed = b.failed;
+  // Only the archives written are synchronised.
+  Fi(n, if (!status[i]) outs[done++] = outs[i]; else free(outs[i]))
+  if (sync != SYNC_NONE) xsync_files(outs, done);
+  xset_sync(sync);
+  Fi(n,
+    if (status[i]) fprintf(stderr, "%s: %s.\n", names[i], status[i]);
+    else if (!o.quiet) fprintf(stderr, "%s: encoded.\n", names[i]);
+  )
+  if (!o.quiet && o.verbose)
+    fprintf(stderr, "%d files encoded, %d failed.\n", n - failed, failed);
+  Fi(done, free(outs[i]))
+  free(outs), free(status);
+  return failed ? 1 : 0;
+}
+int do_joint_test(joint_options_t o) {
+  FILE * in = stdin;
+  if (o.input_name) {
+    validate_file(o.input_name);
+    if(!o.no_map) {
+      #if defined(XPAR_ALLOW_MAPPING)
+      mmap_t map = xpar_map(o.input_name);
+      if (map.map) {
+        int res = test3(map, o.interlacing, o.quiet, o.verbose);
+        xpar_unmap(&map);
+        return res;
+      }
+      #endif
+    }
+    if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+  }
+  int res = test4(in, o.interlacing, o.quiet, o.verbose);
+  fclose(in);
+  return res;
+}
+
+// ============================================================================
+//  In-place repair. Laces are scrubbed first (in parallel if the archive is
+//  mapped) and only the damaged ones are decoded again. Corrected codewords
+//  are re-encoded as a safeguard against miscorrection, and only the bytes
+//  that differ are written back, along with rebuilt block headers and the
+//  corrected header and trailer. Writes are proportional to the damage.
+// ============================================================================
+// A dry patcher only counts the bytes it would have written.
+typedef struct { FILE * f; u8 * map; u64 written; bool dry; } patcher_t;
+static void read_at(patcher_t * p, sz off, u8 * buf, sz len) {
+  if (p->map) { memcpy(buf, p->map + off, len); return; }
+  xfseek(p->f, off);
+  if (xfread(buf, len, p->f) != len) FATAL("Short read.");
+}
+// Releases a range that is to read as zeros. Returns false if it has to be
+// patched instead.
+static bool punch_at(patcher_t * p, sz off, u8 * old, sz len) {
+  if (p->dry || is_zero(old, len)) return false;
+  xfseek(p->f, off);
+  if (!xfpunch(p->f, len)) return false;
+  Fi(len, p->written += old[i] != 0)
+  return true;
+}
+static void patch_at(patcher_t * p, sz off, u8 * old, u8 * new, sz len) {
+  for (sz i = 0, j; i < len; i = j) {
+    if (old[i] == new[i]) { j = i + 1; continue; }
+    for (j = i; j < len && old[j] != new[j]; j++);
+    if (!p->dry) { xfseek(p->f, off + i);  xfwrite(new + i, j - i, p->f); }
+    p->written += j - i;
+  }
+}
+// Corrects a shortened codeword of `len' data bytes followed by its parity.
+static int repair_codeword(patcher_t * p, sz off, sz len, u8 out[N]) {
+  u8 old[N];  memset(out, 0, N);
+  read_at(p, off, old, len + N - K);
+  memcpy(out, old, len);  memcpy(out + K, old + len, N - K);
+  int n = rsd32(out);
+  if (n < 0) return -1;
+  Fi0(K, len, if (out[i]) return -1)
+  if (n > 0) {
+    u8 new[N];  memcpy(new, out, len);  memcpy(new + len, out + K, N - K);
+    patch_at(p, off, old, new, len + N - K);
+  }
+  return n;
+}
+// `bytes' is the amount of data in the lace, or -1 if unknown.
+static bool repair_lace(patcher_t * p, sz off, u8 * in1, u8 * in2,
+                        int ifactor, sz bytes, health_t * h) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  rsd_job_t j = { .cw = in2, .verify = true };
+  read_at(p, off, in1, ibs * N + BLOCK_HDR_SIZE);
+  do_interlacing(in1, in2, ifactor);
+  rsd_lace(&j, ifactor);  int ecc = j.ecc;
+  h->ecc = ecc; h->lost = j.lost;
+  if (j.lost) return false;
+  u8 * hdr = in1 + ibs * N;  block_hdr bhdr = { 0, 0 };
+  if (hdr[0] == 'X') bhdr = parse_block_header(hdr, true);
+  bool hdr_valid = hdr[0] == 'X' && bhdr.bytes <= ibs * K
+                && (bytes == (sz) -1 || bhdr.bytes == bytes);
+  if (bytes == (sz) -1) {
+    if (!hdr_valid) return false;
+    bytes = bhdr.bytes;
+  }
+  u32 crc = 0;  h->bytes = bytes;
+  for (sz i = 0, n, left = bytes; i < ibs && left; i++, left -= n)
+    n = MIN(left, K), crc = crc32c_update(crc, in2 + i * N, n);
+  // A mismatching CRC after corrections could mean a miscorrection: leave
+  // such laces alone. Without corrections, the block header is at fault.
+  if (hdr_valid && crc != bhdr.crc && ecc) return false;
+  h->crc = crc;
+  u8 * o = xmalloc(ibs * N + BLOCK_HDR_SIZE);
+  do_interlacing(in2, o, ifactor);
+  u8 * nh = o + ibs * N;  nh[0] = 'X';
+  nh[1] = bytes >> 16; nh[2] = bytes >> 8; nh[3] = bytes;
+  nh[4] = crc >> 24; nh[5] = crc >> 16; nh[6] = crc >> 8; nh[7] = crc;
+  // A lace of zeros is released from the disk rather than written over.
+  if (is_zero(o, ibs * N) && punch_at(p, off, in1, ibs * N))
+    patch_at(p, off + ibs * N, hdr, nh, BLOCK_HDR_SIZE);
+  else patch_at(p, off, in1, o, ibs * N + BLOCK_HDR_SIZE);
+  free(o);
+  return true;
+}
+// Laces are scrubbed in batches, and those found damaged are then repaired
+// in order, by one thread at a time.
+#define REPAIR_BATCH 256
+typedef struct {
+  patcher_t * p;  int ifactor;  sz laces;  bool has_trailer;  trailer_t tr;
+  sz base;  health_t hs[REPAIR_BATCH];  u8 * in1, * in2;
+  trailer_t chk;  u64 repaired, failed;  bool quiet;
+} repair_batch_t;
+static sz repair_bytes(repair_batch_t * r, sz l) {
+  sz ibs = compute_interlacing_bs(r->ifactor);
+  return r->has_trailer ? trailer_bytes(r->tr, ibs, l)
+       : l + 1 < r->laces ? ibs * K : (sz) -1;
+}
+static void repair_range(void * ctx, sz lo, sz hi) {
+  repair_batch_t * r = ctx;  patcher_t * p = r->p;
+  sz ibs = compute_interlacing_bs(r->ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  u8 * in1 = xmalloc(lace_size), * in2 = xmalloc(ibs * N);
+  for (sz i = lo; i < hi; i++) {
+    sz l = r->base + i, off = HEADER_SIZE + l * lace_size;
+    u8 * lace = p->map ? p->map + off : in1;
+    if (!p->map) read_at(p, off, in1, lace_size);
+    r->hs[i] = scrub_lace(lace, lace + ibs * N, in2, r->ifactor,
+                          repair_bytes(r, l));
+  }
+  free(in1), free(in2);
+}
+static void repair_done(void * ctx, sz i) {
+  repair_batch_t * r = ctx;  health_t h = r->hs[i];  sz l = r->base + i;
+  sz ibs = compute_interlacing_bs(r->ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  if (h.ecc || h.lost || h.bad_header || h.bad_crc) {
+    if (!r->in1) r->in1 = xmalloc(lace_size), r->in2 = xmalloc(ibs * N);
+    if (repair_lace(r->p, HEADER_SIZE + l * lace_size, r->in1, r->in2,
+                    r->ifactor, repair_bytes(r, l), &h)) {
+      r->repaired++;
+      if (!r->quiet) printf("Lace %zu: repaired (%d errors corrected%s).\n",
+        l, h.ecc, h.bad_header || h.bad_crc ? ", block header rewritten" : "");
+    } else {
+      r->failed++;
+      if (!r->quiet) printf("Lace %zu: irreparable.\n", l);
+    }
+  }
+  trailer_add_lace(&r->chk, (block_hdr) { h.bytes, h.crc });
+}
+int do_joint_repair(joint_options_t o) {
+  if (!o.input_name) FATAL("No input file specified.");
+  struct stat st = validate_file(o.input_name);
+  patcher_t p = { .f = NULL, .map = NULL, .written = 0, .dry = false };
+  sz size = st.st_size;
+  if (!(p.f = fopen(o.input_name, "r+b"))) FATAL_PERROR("fopen");
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t map = { NULL, 0 };
+  if (!o.no_map) map = xpar_map(o.input_name), p.map = map.map;
+  #endif
+  u8 cw[N];  trailer_t tr = { 0 }, chk = { 0 };
+  if (size < HEADER_SIZE) FATAL("Truncated file.");
+  int fixed = repair_codeword(&p, 0, 5, cw);
+  if (fixed < 0 || cw[0] != 'X' || cw[1] != 'P' || cw[4] < '1' || cw[4] > '3')
+    FATAL("Invalid header.");
+  if (fixed && !o.quiet) printf("Header: %d errors corrected.\n", fixed);
+  int ifactor = cw[4] - '0';
+  sz ibs = compute_interlacing_bs(ifactor), lace_size = ibs * N + BLOCK_HDR_SIZE;
+  sz body = size - HEADER_SIZE, laces = body / lace_size;
+  sz rest = body % lace_size;
+  bool has_trailer = false, trailer_bad = false;  u64 repaired = 0, failed = 0;
+  u8 old[TRAILER_SIZE];
+  if (rest == TRAILER_SIZE) {
+    sz off = HEADER_SIZE + laces * lace_size;
+    int tf = repair_codeword(&p, off, TRAILER_DATA, cw);
+    has_trailer = tf >= 0 && trailer_from_codeword(cw, ifactor, &tr)
+               && trailer_consistent(tr, ibs) && tr.laces == laces;
+    trailer_bad = !has_trailer;
+    if (tf > 0 && has_trailer && !o.quiet)
+      printf("Trailer: %d errors corrected.\n", tf);
+    read_at(&p, off, old, TRAILER_SIZE);
+  } else if (rest) {
+    if (!o.quiet)
+      fprintf(stderr, "Truncated file: the last %zu bytes can not be "
+        "repaired.\n", rest);
+    failed++;
+  }
+  repair_batch_t r = { &p, ifactor, laces, has_trailer, tr, .quiet = o.quiet };
+  for (r.base = 0; r.base < laces; r.base += REPAIR_BATCH)
+    pool_ordered(MIN(REPAIR_BATCH, laces - r.base),
+                 ifactor != 3 && p.map ? 1 : REPAIR_BATCH,
+                 repair_range, repair_done, &r);
+  free(r.in1), free(r.in2);
+  chk = r.chk;  repaired = r.repaired;  failed += r.failed;
+  if (!failed && has_trailer && (tr.chain != chk.chain || tr.size != chk.size)) {
+    if (!o.quiet)
+      fprintf(stderr, "Trailer does not match the laces, left unchanged.\n");
+    failed++;
+  } else if (!failed && trailer_bad) {
+    u8 b[TRAILER_SIZE];  pack_trailer(b, chk, ifactor);
+    patch_at(&p, HEADER_SIZE + laces * lace_size, old, b, TRAILER_SIZE);
+    if (!o.quiet) printf("Trailer: rebuilt.\n");
+  }
+  #if defined(XPAR_ALLOW_MAPPING)
+  xpar_unmap(&map);
+  #endif
+  xfclose(p.f);
+  if (!o.quiet)
+    printf("%zu laces: %llu repaired, %llu irreparable; %llu bytes written.\n",
+      laces, (unsigned long long) repaired, (unsigned long long) failed,
+      (unsigned long long) p.written);
+  return failed ? 1 : 0;
+}
+
+// ============================================================================
+//  Detached parity (sidecar) files. The data file is left untouched: the
+//  sidecar only holds the parity of every codeword and the block headers,
+//  framed by a header tagged 'S' and the usual trailer. Codeword i of a lace
+//  is made of every ibs-th data byte starting at i, and its parity bytes are
+//  stored in the same order, so that bursts in either file are spread over
+//  all codewords of the lace, as with interlacing in joint mode archives.
+// ============================================================================
+#define SIDECAR_LACE(ibs) ((ibs) * (N - K) + BLOCK_HDR_SIZE)
+typedef struct { u8 * in, * out;  sz istride, ostride, rows, cols; } tile_t;
+static void transpose_range(void * ctx, sz lo, sz hi) {
+  tile_t * t = ctx;
+  for (sz c0 = lo * 64; c0 < MIN(t->cols, hi * 64); c0 += 64)
+    for (sz r0 = 0; r0 < t->rows; r0 += 64)
+      for (sz r = r0; r < MIN(t->rows, r0 + 64); r++)
+        for (sz c = c0; c < MIN(t->cols, c0 + 64); c++)
+          t->out[c * t->ostride + r] = t->in[r * t->istride + c];
+}
+// out[c * ostride + r] = in[r * istride + c] for a rows x cols matrix.
+static void transpose(u8 * restrict in, sz istride, u8 * restrict out,
+                      sz ostride, sz rows, sz cols) {
+  tile_t t = { in, out, istride, ostride, rows, cols };
+  sz tiles = (cols + 63) / 64;
+  pool_for(tiles, rows * cols >= 1 << 20 ? 1 : tiles, transpose_range, &t);
+}
+void do_sidecar_encode(joint_options_t o) {
+  if (!o.input_name) FATAL("Sidecar files require a named input file.");
+  validate_file(o.input_name);
+  FILE * out = open_output(o), * in = NULL;  notty(out);
+  int ifactor = o.interlacing;  sz ibs = compute_interlacing_bs(ifactor);
+  u8 * in_buffer = xlace_alloc(ibs * K), * d = xlace_alloc(ibs * K),
+     * cw = xlace_alloc(ibs * N), * par = xlace_alloc(SIDECAR_LACE(ibs)),
+     * chunk;
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t map = { NULL, 0 };
+  if (!o.no_map) map = xpar_map(o.input_name);
+  sz left = map.size;
+  if (!map.map)
+  #endif
+    if (!(in = fopen(o.input_name, "rb"))) FATAL_PERROR("fopen");
+  write_header(out, 'S', ifactor);
+  trailer_t tr = { 0 };
+  for (sz l = 0, n; ; l++) {
+    #if defined(XPAR_ALLOW_MAPPING)
+    if (map.map)
+      chunk = map.map + l * ibs * K, n = MIN(left, ibs * K), left -= n;
+    else
+    #endif
+      chunk = in_buffer, n = xfread(in_buffer, ibs * K, in);
+    if (!n) break;
+    if (n < ibs * K) {
+      if (chunk != in_buffer) memcpy(in_buffer, chunk, n);
+      memset(in_buffer + n, 0, ibs * K - n);  chunk = in_buffer;
+    }
+    transpose(chunk, ibs, d, K, K, ibs);
+    rse_lace(d, cw, 0, ifactor);
+    transpose(cw + K, N, par, ibs, ibs, N - K);
+    block_hdr bhdr = { n, crc32c(chunk, n) };
+    xfwrite(par, ibs * (N - K), out);
+    write_block_header(out, bhdr);  trailer_add_lace(&tr, bhdr);
+  }
+  write_trailer(out, tr, ifactor);
+  #if defined(XPAR_ALLOW_MAPPING)
+  xpar_unmap(&map);
+  #endif
+  if (in) fclose(in);
+  xlace_free(in_buffer), xlace_free(d), xlace_free(cw), xlace_free(par);
+  xfclose(out);
+}
+typedef struct { patcher_t d, p; sz dsize; int ifactor; } sidecar_t;
+// Decodes the codewords of lace `l' holding `bytes' bytes of data into `cw'.
+// `buf' is scratch space of 2 * ibs * K + SIDECAR_LACE(ibs) bytes. Data past
+// the end of the data file is taken to be zero.
+static health_t sidecar_scrub(sidecar_t * s, sz l, sz bytes, u8 * buf,
+                              u8 * cw) {
+  sz ibs = compute_interlacing_bs(s->ifactor), off = l * ibs * K;
+  u8 * data = buf, * tmp = buf + ibs * K, * par = tmp + ibs * K;
+  rsd_job_t j = { .cw = cw, .verify = true };
+  health_t h;  memset(&h, 0, sizeof(health_t));
+  if (s->d.map && bytes == ibs * K && off + bytes <= s->dsize) data = s->d.map + off;
+  else {
+    sz have = off < s->dsize ? MIN(bytes, s->dsize - off) : 0;
+    if (have) read_at(&s->d, off, data, have);
+    memset(data + have, 0, ibs * K - have);
+  }
+  if (s->p.map) par = s->p.map + HEADER_SIZE + l * SIDECAR_LACE(ibs);
+  else read_at(&s->p, HEADER_SIZE + l * SIDECAR_LACE(ibs), par,
+               SIDECAR_LACE(ibs));
+  transpose(data, ibs, cw, N, K, ibs);
+  transpose(par, ibs, cw + K, N, N - K, ibs);
+  rsd_lace(&j, s->ifactor);
+  h.ecc = j.ecc; h.lost = j.lost; h.bytes = bytes;
+  if (h.ecc) {
+    // Corrections in the zero padding past the data are miscorrections.
+    transpose(cw, N, tmp, ibs, ibs, K);  data = tmp;
+    Fi0(ibs * K, bytes, if (tmp[i]) { h.lost++; break; })
+  }
+  h.crc = crc32c(data, bytes);
+  u8 * hdr = par + ibs * (N - K);  block_hdr bhdr = { 0, 0 };
+  if (hdr[0] == 'X') bhdr = parse_block_header(hdr, true);
+  h.bad_header = hdr[0] != 'X' || bhdr.bytes != bytes;
+  h.bad_crc = !h.bad_header && bhdr.crc != h.crc;
+  return h;
+}
+// Writes back the corrected data and parity of a lace scrubbed into `cw'.
+static void sidecar_patch(sidecar_t * s, sz l, health_t h, u8 * buf,
+                          u8 * cw) {
+  sz ibs = compute_interlacing_bs(s->ifactor), off = l * ibs * K;
+  sz have = off < s->dsize ? MIN(h.bytes, s->dsize - off) : 0;
+  u8 * old = buf, * new = buf + ibs * K, * hdr;
+  read_at(&s->d, off, old, have);  memset(old + have, 0, h.bytes - have);
+  transpose(cw, N, new, ibs, ibs, K);
+  patch_at(&s->d, off, old, new, h.bytes);
+  off = HEADER_SIZE + l * SIDECAR_LACE(ibs);
+  read_at(&s->p, off, old, SIDECAR_LACE(ibs));
+  transpose(cw + K, N, new, ibs, ibs, N - K);
+  hdr = new + ibs * (N - K);  hdr[0] = 'X';
+  hdr[1] = h.bytes >> 16; hdr[2] = h.bytes >> 8; hdr[3] = h.bytes;
+  hdr[4] = h.crc >> 24; hdr[5] = h.crc >> 16; hdr[6] = h.crc >> 8;
+  hdr[7] = h.crc;
+  patch_at(&s->p, off, old, new, SIDECAR_LACE(ibs));
+}
+typedef struct {
+  sidecar_t * s;  trailer_t tr;  bool repair;
+  sz base;  health_t hs[REPAIR_BATCH];  u8 * buf, * cw;
+  trailer_t chk;  scrub_stats_t st;  u64 repaired, failed;  bool quiet, verbose;
+} sidecar_batch_t;
+static void sidecar_range(void * ctx, sz lo, sz hi) {
+  sidecar_batch_t * c = ctx;
+  sz ibs = compute_interlacing_bs(c->s->ifactor);
+  u8 * buf = xmalloc(2 * ibs * K + SIDECAR_LACE(ibs)), * cw = xmalloc(ibs * N);
+  for (sz i = lo; i < hi; i++) {
+    sz l = c->base + i;
+    c->hs[i] = sidecar_scrub(c->s, l, MIN(ibs * K, c->tr.size - l * ibs * K),
+                             buf, cw);
+  }
+  free(buf), free(cw);
+}
+static void sidecar_done(void * ctx, sz i) {
+  sidecar_batch_t * c = ctx;  health_t h = c->hs[i];  sz l = c->base + i;
+  sz ibs = compute_interlacing_bs(c->s->ifactor);
+  trailer_add_lace(&c->chk, (block_hdr) { h.bytes, h.crc });
+  if (!c->repair) { report_lace(&c->st, h, c->quiet, c->verbose); return; }
+  if (!h.ecc && !h.lost && !h.bad_header && !h.bad_crc) return;
+  // A mismatching CRC after corrections could mean a miscorrection.
+  if (h.lost || (h.bad_crc && h.ecc)) {
+    c->failed++;
+    if (!c->quiet) printf("Lace %zu: irreparable.\n", l);
+    return;
+  }
+  if (!c->buf)
+    c->buf = xmalloc(2 * ibs * K + SIDECAR_LACE(ibs)), c->cw = xmalloc(ibs * N);
+  sidecar_scrub(c->s, l, h.bytes, c->buf, c->cw);
+  sidecar_patch(c->s, l, h, c->buf, c->cw);  c->repaired++;
+  if (!c->quiet) printf("Lace %zu: repaired (%d errors corrected%s).\n",
+    l, h.ecc, h.bad_header || h.bad_crc ? ", block header rewritten" : "");
+}
+static int sidecar_check(joint_options_t o, bool repair) {
+  if (!o.input_name || !o.output_name) FATAL("No input file specified.");
+  struct stat dst = validate_file(o.input_name),
+              sst = validate_file(o.output_name);
+  sidecar_t s = { .d = { .f = NULL, .map = NULL, .written = 0, .dry = !repair },
+                  .p = { .f = NULL, .map = NULL, .written = 0, .dry = !repair },
+                  .dsize = 0, .ifactor = 0 };
+  if (!(s.d.f = fopen(o.input_name, repair ? "r+b" : "rb"))
+   || !(s.p.f = fopen(o.output_name, repair ? "r+b" : "rb")))
+    FATAL_PERROR("fopen");
+  #if defined(XPAR_ALLOW_MAPPING)
+  mmap_t dmap = { NULL, 0 }, smap = { NULL, 0 };
+  if (!o.no_map) dmap = xpar_map(o.input_name), smap = xpar_map(o.output_name);
+  s.d.map = dmap.map, s.p.map = smap.map;
+  #endif
+  sz size = sst.st_size;  s.dsize = dst.st_size;
+  u8 cw[N];  trailer_t tr, chk = { 0 };
+  if (size < HEADER_SIZE) FATAL("Truncated file.");
+  int fixed = repair_codeword(&s.p, 0, 5, cw);
+  if (fixed < 0 || cw[0] != 'X' || cw[1] != 'S' || cw[4] < '1' || cw[4] > '3')
+    FATAL("Invalid header.");
+  if (fixed && !o.quiet)
+    printf("Header: %d errors %s.\n", fixed, repair ? "corrected" : "found");
+  s.ifactor = cw[4] - '0';
+  sz ibs = compute_interlacing_bs(s.ifactor), lace_size = SIDECAR_LACE(ibs);
+  // Sidecar laces can be shorter than the trailer.
+  sz body = size - HEADER_SIZE, laces = body / lace_size;
+  bool trailer_bad = true, mismatch = false;
+  if (body >= TRAILER_SIZE && (body - TRAILER_SIZE) % lace_size == 0) {
+    laces = (body - TRAILER_SIZE) / lace_size;
+    int tf = repair_codeword(&s.p, HEADER_SIZE + laces * lace_size,
+                             TRAILER_DATA, cw);
+    trailer_bad = tf < 0 || !trailer_from_codeword(cw, s.ifactor, &tr)
+               || !trailer_consistent(tr, ibs) || tr.laces != laces;
+    if (tf > 0 && !trailer_bad && !o.quiet)
+      printf("Trailer: %d errors %s.\n", tf, repair ? "corrected" : "found");
+    fixed += trailer_bad ? 0 : tf;
+  }
+  if (trailer_bad) {
+    // Without a trailer, the data file is assumed to have the right size.
+    tr = (trailer_t) { s.dsize, laces, 0, 0 };
+    if (!trailer_consistent(tr, ibs))
+      FATAL("The sidecar does not match the data file.");
+  }
+  if (tr.size != s.dsize) {
+    mismatch = true;
+    if (!o.quiet)
+      fprintf(stderr, "Data file size mismatch: expected %llu bytes, "
+        "found %zu.\n", (unsigned long long) tr.size, s.dsize);
+  }
+  sidecar_batch_t c = { &s, tr, repair, .quiet = o.quiet, .verbose = o.verbose };
+  for (c.base = 0; c.base < laces; c.base += REPAIR_BATCH)
+    pool_ordered(MIN(REPAIR_BATCH, laces - c.base),
+                 s.ifactor != 3 && s.d.map && s.p.map ? 1 : REPAIR_BATCH,
+                 sidecar_range, sidecar_done, &c);
+  free(c.buf), free(c.cw);
+  scrub_stats_t st = c.st;  chk = c.chk;
+  u64 repaired = c.repaired, failed = c.failed;
+  if (!trailer_bad && !failed && !st.damaged && tr.chain != chk.chain) {
+    if (!o.quiet)
+      fprintf(stderr, "Trailer does not match the laces%s.\n",
+        repair ? ", left unchanged" : "");
+    failed++;
+  } else if (repair && !failed && trailer_bad) {
+    xfseek(s.p.f, HEADER_SIZE + laces * lace_size);
+    write_trailer(s.p.f, chk, s.ifactor);  s.p.written += TRAILER_SIZE;
+    xftruncate(s.p.f, HEADER_SIZE + laces * lace_size + TRAILER_SIZE);
+    if (!o.quiet) printf("Trailer: rebuilt.\n");
+  }
+  // Restore the tail of a truncated data file once all of it is recovered.
+  if (repair && !failed && s.dsize < tr.size) {
+    xftruncate(s.d.f, tr.size);  mismatch = false;
+  }
+  #if defined(XPAR_ALLOW_MAPPING)
+  xpar_unmap(&dmap);  xpar_unmap(&smap);
+  #endif
+  if (repair) {
+    xfclose(s.d.f);  xfclose(s.p.f);
+    if (!o.quiet)
+      printf("%zu laces: %llu repaired, %llu irreparable; %llu bytes "
+        "written.\n", laces, (unsigned long long) repaired,
+        (unsigned long long) failed,
+        (unsigned long long) (s.d.written + s.p.written));
+    return failed || mismatch ? 1 : 0;
+  }
+  fclose(s.d.f);  fclose(s.p.f);
+  int res = scrub_summary(st, trailer_bad, false, o.quiet);
+  return failed || mismatch ? 1 : res ? res : fixed ? 2 : 0;
+}
+int do_sidecar_test(joint_options_t o) { return sidecar_check(o, false); }
+int do_sidecar_repair(joint_options_t o) { return sidecar_check(o, true); }
+
+// ============================================================================
+//  Library interface (xpar.h). The streaming contexts drive the same lace
+//  encoder and decoder as the command line, but never print anything nor
+//  exit: every failure is returned to the caller as an error code and the
+//  context refuses further work. Decoding is strict, as without -f.
+// ============================================================================
+static void lib_init(void) {
+  static bool ready = false;
+  pool_lock();
+  if (!ready) jmode_gf256_gentab(0x87), ready = true;
+  pool_unlock();
+}
+const char * xpar_strerror(int code) {
+  switch (code) {
+    case XPAR_OK: return "Success";
+    case XPAR_EINVAL: return "Invalid argument";
+    case XPAR_ENOMEM: return "Out of memory";
+    case XPAR_EWRITE: return "Output callback failed";
+    case XPAR_EHEADER: return "Invalid header or block header";
+    case XPAR_ECORRUPT: return "Irrecoverable lace";
+    case XPAR_ECRC: return "CRC mismatch";
+    case XPAR_ETRUNCATED: return "Truncated archive";
+    case XPAR_ETRAILER: return "Trailer mismatch";
+    case XPAR_ESTATE: return "Context already finished";
+    case XPAR_ESPACE: return "Output buffer too small";
+    default: return "Unknown error";
+  }
+}
+void xpar_set_threads(int threads) {
+  static bool ready = false;  bool first;
+  pool_lock();  first = !ready;  ready = true;  pool_unlock();
+  if (first) pool_init(threads, false);
+}
+// Scratch memory is carved out of a single block, a cache line at a time, so
+// that a context allocates once and the buffer calls not at all.
+#define ARENA_ALIGN 64
+typedef struct { u8 * p; } arena_t;
+static sz arena_need(sz n) { return n + ARENA_ALIGN - 1; }
+static u8 * arena_take(arena_t * a, sz n) {
+  uintptr_t p = ((uintptr_t) a->p + ARENA_ALIGN - 1)
+              & ~(uintptr_t) (ARENA_ALIGN - 1);
+  a->p = (u8 *) p + n;
+  return (u8 *) p;
+}
+// Returns the interlacing factor of a header, or zero if it is not valid.
+static int lib_header(const u8 * b) {
+  u8 out[N] = { 0 };
+  memcpy(out, b, 5);  memcpy(out + K, b + 5, N - K);
+  if (rsd32(out) < 0 || out[0] != 'X' || out[1] != 'P'
+   || out[4] < '1' || out[4] > '3')
+    return 0;
+  return out[4] - '0';
+}
+// Encodes `n' bytes of `data' into the lace at `dst', followed by its block
+// header, using `cw' for the codewords.
+static void lib_enc_lace(u8 * data, sz n, u8 * cw, u8 * dst, int ifactor,
+                         trailer_t * tr) {
+  sz ibs = compute_interlacing_bs(ifactor);
+  block_hdr h = encode_lace(data, n, cw, dst, ifactor);
+  pack_block_header(dst + ibs * N, h);  trailer_add_lace(tr, h);
+}
+// Decodes the lace at `lace' into `out', which has room for a full lace of
+// data, de-interlacing the codewords into `cw'.
+static int lib_dec_lace(const u8 * lace, int ifactor, u8 * cw, u8 * out,
+                        block_hdr * h, u64 * ecc) {
+  sz ibs = compute_interlacing_bs(ifactor);  u8 * hdr = (u8 *) lace + ibs * N;
+  if (hdr[0] != 'X') return XPAR_EHEADER;
+  *h = parse_block_header(hdr, true);
+  if (h->bytes > ibs * K) return XPAR_EHEADER;
+  rsd_job_t j = { .cw = cw, .out = out, .bytes = h->bytes };
+  u32 crc = zero_crc(h->bytes);
+  if (is_zero((u8 *) lace, ibs * N)) memset(out, 0, h->bytes);
+  else {
+    do_interlacing((u8 *) lace, cw, ifactor);
+    rsd_lace(&j, ifactor);  *ecc += j.ecc;  crc = j.crc;
+    if (j.lost) return XPAR_ECORRUPT;
+  }
+  if (crc != h->crc) return XPAR_ECRC;
+  return XPAR_OK;
+}
+struct xpar_enc {
+  xpar_write_fn write;  void * opaque;  int ifactor, err;
+  sz fill;  u8 * in, * o1, * o2;  trailer_t tr;
+};
+// The block header is packed after the lace, so that both are written at
+// once.
+static int enc_lace(xpar_enc * e, u8 * data, sz n) {
+  sz ibs = compute_interlacing_bs(e->ifactor);
+  lib_enc_lace(data, n, e->o1, e->o2, e->ifactor, &e->tr);
+  if (e->write(e->opaque, e->o2, ibs * N + BLOCK_HDR_SIZE)) e->err = XPAR_EWRITE;
+  return e->err;
+}
+int xpar_enc_init(xpar_enc ** enc, int interlacing, xpar_write_fn write,
+                  void * opaque) {
+  if (!enc || !write || interlacing < 1 || interlacing > 3) return XPAR_EINVAL;
+  lib_init();
+  sz ibs = compute_interlacing_bs(interlacing);  u8 h[HEADER_SIZE];
+  xpar_enc * e = calloc(1, sizeof(xpar_enc) + arena_need(ibs * K)
+    + arena_need(ibs * N) + arena_need(ibs * N + BLOCK_HDR_SIZE));
+  if (!e) return XPAR_ENOMEM;
+  arena_t a = { (u8 *) (e + 1) };
+  e->write = write, e->opaque = opaque, e->ifactor = interlacing;
+  e->in = arena_take(&a, ibs * K), e->o1 = arena_take(&a, ibs * N);
+  e->o2 = arena_take(&a, ibs * N + BLOCK_HDR_SIZE);
+  pack_header(h, 'P', interlacing);
+  if (write(opaque, h, HEADER_SIZE)) { free(e);  return XPAR_EWRITE; }
+  *enc = e;
+  return XPAR_OK;
+}
+int xpar_enc_update(xpar_enc * e, const uint8_t * data, size_t len) {
+  if (!e || (!data && len)) return XPAR_EINVAL;
+  sz lace = compute_interlacing_bs(e->ifactor) * K;
+  while (len && !e->err) {
+    // Full laces are only read by the encoder, not padded.
+    if (!e->fill && len >= lace) {
+      enc_lace(e, (u8 *) data, lace);  data += lace, len -= lace;
+      continue;
+    }
+    sz n = MIN(len, lace - e->fill);
+    memcpy(e->in + e->fill, data, n);  e->fill += n, data += n, len -= n;
+    if (e->fill == lace) enc_lace(e, e->in, lace), e->fill = 0;
+  }
+  return e->err;
+}
+int xpar_enc_finish(xpar_enc * e) {
+  if (!e) return XPAR_EINVAL;
+  if (e->err) return e->err;
+  if (e->fill && enc_lace(e, e->in, e->fill)) return e->err;
+  pack_trailer(e->o2, e->tr, e->ifactor);
+  e->err = e->write(e->opaque, e->o2, TRAILER_SIZE) ? XPAR_EWRITE : XPAR_ESTATE;
+  return e->err == XPAR_ESTATE ? XPAR_OK : e->err;
+}
+void xpar_enc_free(xpar_enc * e) { free(e); }
+struct xpar_dec {
+  xpar_write_fn write;  void * opaque;  int ifactor, err;
+  sz fill;  u8 * mem, * lace, * in2, * out;  u64 ecc;  trailer_t tr;
+  u8 head[HEADER_SIZE];
+};
+static int dec_lace(xpar_dec * d, u8 * lace) {
+  block_hdr h;
+  d->err = lib_dec_lace(lace, d->ifactor, d->in2, d->out, &h, &d->ecc);
+  if (d->err) return d->err;
+  trailer_add_lace(&d->tr, h);
+  if (d->write(d->opaque, d->out, h.bytes)) d->err = XPAR_EWRITE;
+  return d->err;
+}
+int xpar_dec_init(xpar_dec ** dec, xpar_write_fn write, void * opaque) {
+  if (!dec || !write) return XPAR_EINVAL;
+  lib_init();
+  xpar_dec * d = calloc(1, sizeof(xpar_dec));
+  if (!d) return XPAR_ENOMEM;
+  d->write = write, d->opaque = opaque;  *dec = d;
+  return XPAR_OK;
+}
+// The buffers are sized once the header tells the interlacing factor.
+static int dec_header(xpar_dec * d) {
+  if (!(d->ifactor = lib_header(d->head))) return d->err = XPAR_EHEADER;
+  sz ibs = compute_interlacing_bs(d->ifactor);
+  d->mem = malloc(arena_need(ibs * N + BLOCK_HDR_SIZE) + arena_need(ibs * N)
+                + arena_need(ibs * K));
+  if (!d->mem) return d->err = XPAR_ENOMEM;
+  arena_t a = { d->mem };
+  d->lace = arena_take(&a, ibs * N + BLOCK_HDR_SIZE);
+  d->in2 = arena_take(&a, ibs * N), d->out = arena_take(&a, ibs * K);
+  return d->err;
+}
+int xpar_dec_update(xpar_dec * d, const uint8_t * data, size_t len) {
+  if (!d || (!data && len)) return XPAR_EINVAL;
+  while (len && !d->err) {
+    if (!d->ifactor) {
+      sz n = MIN(len, HEADER_SIZE - d->fill);
+      memcpy(d->head + d->fill, data, n);  d->fill += n, data += n, len -= n;
+      if (d->fill == HEADER_SIZE && !dec_header(d)) d->fill = 0;
+      continue;
+    }
+    sz lace_size = compute_interlacing_bs(d->ifactor) * N + BLOCK_HDR_SIZE;
+    if (!d->fill && len >= lace_size) {
+      // The lace is only read, into the de-interlacing buffer.
+      dec_lace(d, (u8 *) data);  data += lace_size, len -= lace_size;
+      continue;
+    }
+    sz n = MIN(len, lace_size - d->fill);
+    memcpy(d->lace + d->fill, data, n);  d->fill += n, data += n, len -= n;
+    if (d->fill == lace_size) dec_lace(d, d->lace), d->fill = 0;
+  }
+  return d->err;
+}
+// The trailer is what is left once the laces are decoded, and is held back
+// like a partial lace; archives without one are accepted.
+int xpar_dec_finish(xpar_dec * d) {
+  if (!d) return XPAR_EINVAL;
+  if (d->err) return d->err;
+  trailer_t t;
+  if (!d->ifactor || (d->fill && d->fill != TRAILER_SIZE))
+    d->err = XPAR_ETRUNCATED;
+  else if (d->fill && (!unpack_trailer(d->lace, d->ifactor, &t)
+                       || t.laces != d->tr.laces || t.size != d->tr.size
+                       || t.chain != d->tr.chain))
+    d->err = XPAR_ETRAILER;
+  if (d->err) return d->err;
+  d->err = XPAR_ESTATE;
+  return XPAR_OK;
+}
+uint64_t xpar_dec_corrected(const xpar_dec * d) { return d ? d->ecc : 0; }
+void xpar_dec_free(xpar_dec * d) {
+  if (d) free(d->mem), free(d);
+}
+
+// ============================================================================
+//  Buffer calls. Whole archives held in memory are encoded, decoded and
+//  verified between caller-owned buffers, with caller-owned scratch memory
+//  for the codewords and for a lace of data. Full laces are encoded straight
+//  from the input into the output, and decoded straight into the output
+//  where it has room for them; only the last lace goes through the scratch.
+//  Nothing is allocated, which keeps many small archives cheap.
+// ============================================================================
+static sz buf_scratch(sz ibs) {
+  return arena_need(ibs * N) + arena_need(ibs * K);
+}
+int xpar_encode_size(size_t len, int interlacing, size_t * out_size,
+                     size_t * scratch) {
+  if (interlacing < 1 || interlacing > 3) return XPAR_EINVAL;
+  sz ibs = compute_interlacing_bs(interlacing), lace = ibs * K;
+  if (out_size)
+    *out_size = HEADER_SIZE + TRAILER_SIZE
+              + (len + lace - 1) / lace * (ibs * N + BLOCK_HDR_SIZE);
+  if (scratch) *scratch = buf_scratch(ibs);
+  return XPAR_OK;
+}
+int xpar_encode(const uint8_t * in, size_t len, int interlacing, uint8_t * out,
+                size_t out_size, size_t * written, void * scratch) {
+  sz need;
+  if ((!in && len) || !out || !scratch
+   || xpar_encode_size(len, interlacing, &need, NULL))
+    return XPAR_EINVAL;
+  if (out_size < need) return XPAR_ESPACE;
+  lib_init();
+  sz ibs = compute_interlacing_bs(interlacing), lace = ibs * K;
+  arena_t a = { scratch };  trailer_t tr = { 0 };
+  u8 * cw = arena_take(&a, ibs * N), * last = arena_take(&a, ibs * K);
+  u8 * dst = out + HEADER_SIZE;
+  pack_header(out, 'P', interlacing);
+  for (sz off = 0; off < len; off += lace, dst += ibs * N + BLOCK_HDR_SIZE) {
+    // Only the last lace is padded, so it is copied first.
+    sz n = MIN(lace, len - off);  u8 * data = (u8 *) in + off;
+    if (n < lace) data = memcpy(last, data, n);
+    lib_enc_lace(data, n, cw, dst, interlacing, &tr);
+  }
+  pack_trailer(dst, tr, interlacing);
+  if (written) *written = need;
+  return XPAR_OK;
+}
+// An archive held in memory: laces of a fixed size after the header, then
+// the trailer if there is one.
+typedef struct { int ifactor; sz laces; bool trailer; trailer_t t; } layout_t;
+static int buf_layout(const u8 * in, sz len, layout_t * l) {
+  if (!in) return XPAR_EINVAL;
+  if (len < HEADER_SIZE) return XPAR_ETRUNCATED;
+  lib_init();
+  if (!(l->ifactor = lib_header(in))) return XPAR_EHEADER;
+  sz ibs = compute_interlacing_bs(l->ifactor);
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  sz rest = (len - HEADER_SIZE) % lace_size;
+  l->laces = (len - HEADER_SIZE) / lace_size;  l->trailer = rest != 0;
+  if (rest && rest != TRAILER_SIZE) return XPAR_ETRUNCATED;
+  if (l->trailer && (!unpack_trailer(in + len - TRAILER_SIZE, l->ifactor, &l->t)
+                  || l->t.laces != l->laces || !trailer_consistent(l->t, ibs)))
+    return XPAR_ETRAILER;
+  return XPAR_OK;
+}
+int xpar_decode_size(const uint8_t * in, size_t len, size_t * out_size,
+                     size_t * scratch) {
+  layout_t l;  int err = buf_layout(in, len, &l);
+  if (err) return err;
+  sz ibs = compute_interlacing_bs(l.ifactor);
+  if (out_size) *out_size = l.trailer ? l.t.size : l.laces * ibs * K;
+  if (scratch) *scratch = buf_scratch(ibs);
+  return XPAR_OK;
+}
+// Without `store', the data is only checked.
+static int buf_decode(const u8 * in, sz len, bool store, u8 * out, sz out_size,
+                      sz * written, void * scratch, uint64_t * corrected) {
+  layout_t l;  int err = buf_layout(in, len, &l);
+  if (err) return err;
+  if (!scratch) return XPAR_EINVAL;
+  sz ibs = compute_interlacing_bs(l.ifactor), off = 0;
+  sz lace_size = ibs * N + BLOCK_HDR_SIZE;
+  arena_t a = { scratch };  trailer_t tr = { 0 };  u64 ecc = 0;  block_hdr h;
+  u8 * cw = arena_take(&a, ibs * N), * last = arena_take(&a, ibs * K);
+  for (sz i = 0; i < l.laces && !err; i++) {
+    bool direct = store && out_size - off >= ibs * K;
+    err = lib_dec_lace(in + HEADER_SIZE + i * lace_size, l.ifactor, cw,
+                       direct ? out + off : last, &h, &ecc);
+    if (err) break;
+    if (store && h.bytes > out_size - off) err = XPAR_ESPACE;
+    else if (store && !direct) memcpy(out + off, last, h.bytes);
+    off += h.bytes;  trailer_add_lace(&tr, h);
+  }
+  if (!err && l.trailer && (tr.size != l.t.size || tr.chain != l.t.chain))
+    err = XPAR_ETRAILER;
+  if (corrected) *corrected = ecc;
+  if (written) *written = off;
+  return err;
+}
+int xpar_decode(const uint8_t * in, size_t len, uint8_t * out, size_t out_size,
+                size_t * written, void * scratch, uint64_t * corrected) {
+  if (!out && out_size) return XPAR_EINVAL;
+  return buf_decode(in, len, true, out, out_size, written, scratch, corrected);
+}
+int xpar_verify(const uint8_t * in, size_t len, void * scratch,
+                uint64_t * corrected) {
+  return buf_decode(in, len, false, NULL, 0, NULL, scratch, corrected);
 }
@@ -27,10 +27,21 @@ typedef struct {
   const char * input_name, * output_name;
   int interlacing; // 1-3 inclusive.
   bool force, quiet, verbose, no_map;
+  bool append, update; // Encoding only: modify an existing archive.
+  bool resume; // Save checkpoints and continue from the last one.
+  const char * replica; // Decoding only: a second copy of the archive.
 } joint_options_t;
 
 void jmode_gf256_gentab(u8 poly);
 void do_joint_encode(joint_options_t o);
 void do_joint_decode(joint_options_t o);
+int do_joint_test(joint_options_t o);
+int do_joint_repair(joint_options_t o);
+// Encodes each of `names' to an archive named after it.
+int do_joint_batch(joint_options_t o, char ** names, int n);
+// Detached parity: `input_name' is the data file, `output_name' the sidecar.
+void do_sidecar_encode(joint_options_t o);
+int do_sidecar_test(joint_options_t o);
+int do_sidecar_repair(joint_options_t o);
 
 #endif
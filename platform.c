@@ -16,6 +16,7 @@
 */
 
 #include "platform.h"
+#include "pool.h"
 
 #if !defined(HAVE_ASPRINTF)
 int asprintf(char **strp, const char *fmt, ...) {
@@ -43,6 +44,16 @@ int asprintf(char **strp, const char *fmt, ...) {
   }
 #endif
 
+#if !defined(HAVE_MEMMEM)
+  void * memmem(const void * h, sz hn, const void * n, sz nn) {
+    const u8 * p = h, * end = p + hn, * s = n;
+    if (!nn) return (void *) h;
+    for (; (p = memchr(p, s[0], end - p)) && (sz) (end - p) >= nn; p++)
+      if (!memcmp(p, s, nn)) return (void *) p;
+    return NULL;
+  }
+#endif
+
 #if defined(HAVE_MMAP)
   #include <sys/mman.h>
   #include <sys/stat.h>
@@ -108,6 +119,9 @@ mmap_t xpar_map(const char * filename) {
     close(fd); return mappedFile;
   }
   close(fd);
+  #if defined(HAVE_MADVISE) && defined(MADV_SEQUENTIAL)
+  madvise(mappedFile.map, mappedFile.size, MADV_SEQUENTIAL);
+  #endif
   // Reserve a single page at the end of the allocation
 
 #endif
@@ -137,7 +151,7 @@ void platform_init(void) {
 }
 
 #include <errno.h>
-void xfclose(FILE * des) {
+void xfsync(FILE * des) {
   if(fflush(des)) FATAL_PERROR("fflush");
 #if defined(HAVE__COMMIT)
   if (_commit(fileno(des))) FATAL_PERROR("commit");
@@ -148,8 +162,49 @@ void xfclose(FILE * des) {
     errno = 0;
   }
 #endif
+}
+// How written files are made durable: SYNC_NONE leaves it to the operating
+// system, SYNC_END syncs them as they are closed and SYNC_INCREMENTAL also
+// writes them back as they are produced, `sync_laces' laces at a time (or a
+// window of the page cache if zero), so that the final sync is short.
+static int sync_mode = SYNC_END;
+static sz sync_laces;
+int xset_sync(int mode) { int prev = sync_mode; sync_mode = mode; return prev; }
+void xset_sync_laces(sz laces) { sync_laces = laces; }
+sz xsync_laces(void) { return sync_laces; }
+void xfclose(FILE * des) {
+  if (sync_mode != SYNC_NONE) xfsync(des);
   if (fclose(des) == EOF) FATAL_PERROR("fclose");
 }
+#if defined(HAVE_SYNCFS)
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+// Makes files written with SYNC_NONE durable at once. A file system is synced
+// as a whole where possible, which is far cheaper than syncing its files one
+// at a time. Files that can not be opened are skipped.
+void xsync_files(char ** names, int n) {
+#if defined(HAVE_SYNCFS)
+  dev_t * seen = xmalloc(n * sizeof(dev_t));  int devs = 0;
+  Fi(n,
+    struct stat st;  int fd = open(names[i], O_RDONLY), j = 0;
+    if (fd == -1) continue;
+    if (!fstat(fd, &st)) {
+      while (j < devs && seen[j] != st.st_dev) j++;
+      if (j == devs && syncfs(fd)) FATAL_PERROR("syncfs");
+      if (j == devs) seen[devs++] = st.st_dev;
+    }
+    close(fd);
+  )
+  free(seen);
+#else
+  Fi(n,
+    FILE * f = fopen(names[i], "rb+");
+    if (f) xfsync(f), fclose(f);
+  )
+#endif
+}
 void xfwrite(const void * ptr, sz size, FILE * stream) {
   if (fwrite(ptr, 1, size, stream) != size) FATAL_PERROR("fwrite");
   if (ferror(stream)) FATAL_PERROR("fwrite");
@@ -173,4 +228,248 @@ void notty(FILE * des) {
 }
 bool is_seekable(FILE * des) {
   return fseek(des, 0, SEEK_CUR) != -1;
-}
\ No newline at end of file
+}
+#if defined(HAVE_POSIX_FALLOCATE)
+  #include <fcntl.h>
+#endif
+void xpreallocate(FILE * des, sz size) {
+  // Only a hint: pipes, terminals and some file systems will refuse.
+  #if defined(HAVE_POSIX_FALLOCATE)
+  if (size) posix_fallocate(fileno(des), 0, size);
+  #endif
+  (void) des; (void) size;
+}
+void xfseek(FILE * des, sz offset) {
+  #if defined(HAVE_FSEEKO)
+  if (fseeko(des, (off_t) offset, SEEK_SET)) FATAL_PERROR("fseek");
+  #elif defined(HAVE__FSEEKI64)
+  if (_fseeki64(des, (__int64) offset, SEEK_SET)) FATAL_PERROR("fseek");
+  #else
+  if (fseek(des, (long) offset, SEEK_SET)) FATAL_PERROR("fseek");
+  #endif
+}
+#if defined(HAVE_FTRUNCATE)
+  #include <unistd.h>
+#endif
+void xftruncate(FILE * des, sz size) {
+  if (fflush(des)) FATAL_PERROR("fflush");
+  #if defined(HAVE_FTRUNCATE)
+  if (ftruncate(fileno(des), (off_t) size)) FATAL_PERROR("ftruncate");
+  #elif defined(HAVE__CHSIZE_S)
+  if (_chsize_s(fileno(des), (__int64) size)) FATAL_PERROR("chsize");
+  #else
+  FATAL("Truncating files is not supported on this platform.");
+  #endif
+}
+// Seeks `n' bytes forward. Returns false if the stream is not seekable.
+bool xfskip(FILE * des, sz n) {
+  #if defined(HAVE_FSEEKO)
+  return !fseeko(des, (off_t) n, SEEK_CUR);
+  #elif defined(HAVE__FSEEKI64)
+  return !_fseeki64(des, (__int64) n, SEEK_CUR);
+  #else
+  return !fseek(des, (long) n, SEEK_CUR);
+  #endif
+}
+#if defined(HAVE_FALLOCATE) || defined(HAVE_STAT)
+  #include <fcntl.h>
+  #include <sys/stat.h>
+#endif
+// Moves past `n' bytes that are to read as zeros. Bytes past the end of the
+// file are skipped, and those inside it are released by punching a hole
+// where the file system can. Returns false if they have to be written.
+bool xfpunch(FILE * des, sz n) {
+  if (fflush(des)) FATAL_PERROR("fflush");
+  #if defined(HAVE_FSEEKO)
+  off_t pos = ftello(des);
+  #else
+  long pos = ftell(des);
+  #endif
+  if (pos < 0) return false;
+  #if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (!fallocate(fileno(des), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 (off_t) pos, (off_t) n))
+    return xfskip(des, n);
+  #endif
+  #if defined(HAVE_STAT)
+  struct stat st;
+  if (!fstat(fileno(des), &st) && (sz) pos >= (sz) st.st_size)
+    return xfskip(des, n);
+  #endif
+  return false;
+}
+#if defined(HAVE_LSEEK)
+  #include <unistd.h>
+#endif
+// Finds the first extent of data [*data, *hole) at or after `offset'. The
+// rest of the file is reported as data if holes can not be detected. Moves
+// the offset of the underlying file descriptor.
+void xdata_extent(FILE * des, sz offset, sz * data, sz * hole) {
+  *data = offset, *hole = (sz) -1;
+  #if defined(HAVE_LSEEK) && defined(SEEK_DATA) && defined(SEEK_HOLE)
+  if (!des) return;
+  off_t d = lseek(fileno(des), (off_t) offset, SEEK_DATA), h;
+  if (d == -1) {
+    // ENXIO: there is no data past `offset'.
+    if (errno == ENXIO) *data = (sz) -1;
+    errno = 0;  return;
+  }
+  *data = d;
+  if ((h = lseek(fileno(des), d, SEEK_HOLE)) != -1) *hole = h;
+  #else
+  (void) des;
+  #endif
+}
+
+#if defined(HAVE_POSIX_FADVISE) || defined(HAVE_SYNC_FILE_RANGE)
+  #include <fcntl.h>
+#endif
+// Only whole pages inside the range are advised on, so that pages shared
+// with neighbouring data are left alone.
+void xmadvise(u8 * map, sz size, bool willneed) {
+  #if defined(HAVE_MADVISE) && defined(MADV_WILLNEED) && defined(MADV_DONTNEED)
+  uintptr_t lo = ((uintptr_t) map + 4095) & ~(uintptr_t) 4095;
+  uintptr_t hi = ((uintptr_t) map + size) & ~(uintptr_t) 4095;
+  if (willneed) lo = (uintptr_t) map & ~(uintptr_t) 4095;
+  if (map && hi > lo)
+    madvise((void *) lo, hi - lo, willneed ? MADV_WILLNEED : MADV_DONTNEED);
+  #endif
+  (void) map; (void) size; (void) willneed;
+}
+void xfadvise(FILE * des, sz offset, sz size, bool willneed) {
+  #if defined(HAVE_POSIX_FADVISE)
+  if (des && size)
+    posix_fadvise(fileno(des), (off_t) offset, (off_t) size,
+                  willneed ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+  #endif
+  (void) des; (void) offset; (void) size; (void) willneed;
+}
+// Starts writing back the given range of a file, or with `wait', also waits
+// until the range is written and drops its pages.
+void xfwriteback(FILE * des, sz offset, sz size, bool wait) {
+  if (!size || sync_mode != SYNC_INCREMENTAL) return;
+  #if defined(HAVE_SYNC_FILE_RANGE)
+  sync_file_range(fileno(des), (off_t) offset, (off_t) size,
+    wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+         | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE);
+  #endif
+  if (wait) xfadvise(des, offset, size, false);
+  (void) des; (void) offset;
+}
+
+#if defined(HAVE_VMSPLICE)
+  #include <fcntl.h>
+  #include <sys/uio.h>
+  #include <sys/stat.h>
+#endif
+#if defined(HAVE_VMSPLICE) && defined(F_GETPIPE_SZ)
+struct xpipe { FILE * des; int fd, n, cur; sz size; u8 * buf[]; };
+// Small buffers would need too many calls to be worth it.
+xpipe_t * xpipe_open(FILE * des, sz size) {
+  struct stat st;  int fd = fileno(des), cap;
+  if (size < 16384 || fstat(fd, &st) || !S_ISFIFO(st.st_mode)
+   || (cap = fcntl(fd, F_GETPIPE_SZ)) <= 0)
+    return NULL;
+  // Twice the capacity, in case the reader enlarges the pipe.
+  int n = 1 + (2 * (sz) cap + size - 1) / size;
+  xpipe_t * p = xmalloc(sizeof(xpipe_t) + n * sizeof(u8 *));
+  p->des = des, p->fd = fd, p->n = n, p->cur = 0, p->size = size;
+  Fi(n, if (posix_memalign((void **) &p->buf[i], 4096, size))
+          FATAL_PERROR("posix_memalign"))
+  return p;
+}
+u8 * xpipe_buffer(xpipe_t * p) { return p->buf[p->cur]; }
+// Hands the first `size' bytes of the current buffer to the pipe and moves
+// on to the next one. Falls back to copying if the pipe has grown so large
+// that the buffers in turn no longer cover it.
+void xpipe_write(xpipe_t * p, sz size) {
+  u8 * b = p->buf[p->cur];  int cap = fcntl(p->fd, F_GETPIPE_SZ);
+  bool safe = cap > 0 && (sz) cap <= (p->n - 1) * p->size;
+  if (fflush(p->des)) FATAL_PERROR("fflush");
+  while (size) {
+    struct iovec v = { b, size };
+    ssize_t w = safe ? vmsplice(p->fd, &v, 1, 0) : write(p->fd, b, size);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) FATAL_PERROR(safe ? "vmsplice" : "write");
+    b += w, size -= w;
+  }
+  p->cur = (p->cur + 1) % p->n;
+}
+void xpipe_close(xpipe_t * p) {
+  if (!p) return;
+  Fi(p->n, free(p->buf[i]))
+  free(p);
+}
+#else
+xpipe_t * xpipe_open(FILE * des, sz size) {
+  (void) des; (void) size; return NULL;
+}
+u8 * xpipe_buffer(xpipe_t * p) { (void) p; return NULL; }
+void xpipe_write(xpipe_t * p, sz size) { (void) p; (void) size; }
+void xpipe_close(xpipe_t * p) { (void) p; }
+#endif
+
+// Buffers smaller than a huge page gain nothing from the arena. The laces of
+// all interlacing factors but the largest fall under the threshold.
+#define LACE_ARENA_MIN (2 << 20)
+#define LACE_ARENA_SLOTS 16
+static struct { u8 * p; sz size; bool used; } arena[LACE_ARENA_SLOTS];
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+static void touch_pages(void * ctx, sz lo, sz hi) {
+  for (sz i = lo; i < hi; i++) ((u8 *) ctx)[i * 4096] = 0;
+}
+static void * lace_map(sz size) {
+  void * p = MAP_FAILED;
+  #if defined(MAP_HUGETLB)
+  // Only succeeds if huge pages were reserved by the administrator.
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  #endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    #if defined(MADV_HUGEPAGE)
+    madvise(p, size, MADV_HUGEPAGE);
+    #endif
+  }
+  // The pages are placed on the NUMA node of the thread that touches them
+  // first. The loops over laces split the codewords between the threads in
+  // the same static partition, so a thread keeps to the same part of the
+  // buffer, up to the rounding of its size.
+  pool_static(size / 4096, touch_pages, p);
+  return p;
+}
+#else
+static void * lace_map(sz size) { (void) size; return NULL; }
+#endif
+void * xlace_alloc(sz size) {
+  if (size < LACE_ARENA_MIN) return xmalloc(size);
+  sz rounded = (size + LACE_ARENA_MIN - 1) & ~(sz) (LACE_ARENA_MIN - 1);
+  u8 * p = NULL;  int slot = -1;
+  pool_lock();
+  for (int i = 0; i < LACE_ARENA_SLOTS && !p; i++)
+    if (!arena[i].used && arena[i].size == rounded)
+      arena[i].used = true, p = arena[i].p;
+    else if (!arena[i].used && !arena[i].p && slot < 0)
+      slot = i;
+  if (!p && slot >= 0) arena[slot].used = true;
+  pool_unlock();
+  if (p) return p;
+  if (slot >= 0) p = lace_map(rounded);
+  if (slot >= 0) {
+    pool_lock();
+    if (p) arena[slot].p = p, arena[slot].size = rounded;
+    else arena[slot].used = false;
+    pool_unlock();
+  }
+  return p ? p : xmalloc(size);
+}
+void xlace_free(void * ptr) {
+  bool found = false;
+  pool_lock();
+  for (int i = 0; i < LACE_ARENA_SLOTS && !found; i++)
+    if (arena[i].p == ptr) arena[i].used = false, found = true;
+  pool_unlock();
+  if (!found) free(ptr);
+}
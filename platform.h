@@ -32,6 +32,10 @@
   char * strndup(const char *s, sz n);
 #endif
 
+#if !defined(HAVE_MEMMEM)
+  void * memmem(const void * h, sz hn, const void * n, sz nn);
+#endif
+
 // ============================================================================
 //  Cross-platform (Linux + Windows) file mapping interface.
 // ============================================================================
@@ -51,11 +55,56 @@ void platform_init(void);
 //  Safe I/O and memory allocation functions: terminate upon error.
 //  Also utilise platform-specific behaviours to ensure data integrity.
 // ============================================================================
+enum { SYNC_NONE, SYNC_END, SYNC_INCREMENTAL };
+int xset_sync(int mode);
+void xset_sync_laces(sz laces);
+sz xsync_laces(void);
+void xsync_files(char ** names, int n);
+void xfsync(FILE * des);
 void xfclose(FILE * des);
 void xfwrite(const void * ptr, sz size, FILE * stream);
 sz xfread(void * ptr, sz size, FILE * stream);
 void * xmalloc(sz size);
 void notty(FILE * des);
 bool is_seekable(FILE * des);
+void xpreallocate(FILE * des, sz size);
+void xfseek(FILE * des, sz offset);
+void xftruncate(FILE * des, sz size);
+bool xfskip(FILE * des, sz n);
+bool xfpunch(FILE * des, sz n);
+void xdata_extent(FILE * des, sz offset, sz * data, sz * hole);
+
+// ============================================================================
+//  Page cache hints. All of them are advisory and fail silently, e.g. on
+//  pipes or on platforms that lack them. Writeback, and dropping the pages
+//  written back, only happens with SYNC_INCREMENTAL.
+// ============================================================================
+void xmadvise(u8 * map, sz size, bool willneed);
+void xfadvise(FILE * des, sz offset, sz size, bool willneed);
+void xfwriteback(FILE * des, sz offset, sz size, bool wait);
+
+// ============================================================================
+//  Zero-copy output to pipes. The pages of a buffer handed to the pipe are
+//  read by the other end straight from memory, so buffers are used in turn,
+//  and there are enough of them that the pipe can not hold any data from a
+//  buffer by the time it is filled again. xpipe_open returns NULL if `des' is
+//  not a pipe or if the platform lacks vmsplice. There is no input side:
+//  splice only moves data between a pipe and a file descriptor, never into
+//  user memory, and every byte read has to be in user memory for the CRCs
+//  and the code to be computed. stdio already reads most of a lace from a
+//  pipe straight into the lace buffer, so there is no copy to save.
+// ============================================================================
+typedef struct xpipe xpipe_t;
+xpipe_t * xpipe_open(FILE * des, sz size);
+u8 * xpipe_buffer(xpipe_t * p);
+void xpipe_write(xpipe_t * p, sz size);
+void xpipe_close(xpipe_t * p);
+
+// ============================================================================
+//  Lace buffers. Large buffers are mapped with huge pages where possible,
+//  first touched by the threads that process them and kept for reuse.
+// ============================================================================
+void * xlace_alloc(sz size);
+void xlace_free(void * ptr);
 
 #endif
@@ -0,0 +1,263 @@
+/*
+   Copyright (C) 2022-2024 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE // CPU_SET and pthread_setaffinity_np.
+#endif
+
+#include "pool.h"
+#include "platform.h"
+
+#if defined(XPAR_THREADS)
+  #include <pthread.h>
+  #include <unistd.h>
+  #if defined(HAVE_SCHED_GETAFFINITY)
+    #include <sched.h>
+  #endif
+#endif
+
+// ============================================================================
+//  Work stealing. A loop is cut into at most a few ranges per thread, and the
+//  ranges are pushed onto the deque of the thread that started the loop. A
+//  thread takes the most recently pushed range from its own deque and, when
+//  it runs dry, the oldest range from the deque of another thread. Nested
+//  loops thus run depth first on the thread that started them, while idle
+//  threads pick up the largest remaining pieces of work. A thread waiting
+//  for a loop to finish keeps running ranges, of any loop, in the meantime.
+//  Ranges of static loops go to a second deque of the thread they belong to,
+//  which is never stolen from and is served first.
+// ============================================================================
+static int nthreads = 1;
+
+#if defined(XPAR_THREADS)
+typedef struct {
+  pool_fn fn;  pool_done_fn done;  void * ctx;
+  sz n, chunks, left, next;
+  bool emitting, * finished;
+} job_t;
+
+static sz chunk_count(sz n, sz grain, int threads) {
+  sz chunks = grain ? n / grain : n;
+  if (chunks > (sz) threads * 4) chunks = (sz) threads * 4;
+  return chunks ? chunks : 1;
+}
+
+typedef struct { job_t * j; sz c; } task_t;
+typedef struct {
+  pthread_mutex_t m;
+  task_t * ring;  sz head, count, cap;
+} deque_t;
+
+static deque_t * deques, * pinned;
+static pthread_key_t self_key;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static sz queued; // Guarded by `lock', as are all job_t fields.
+
+static int self(void) {
+  void * p = pthread_getspecific(self_key);
+  return p ? (int) (intptr_t) p - 1 : 0;
+}
+
+static void push(deque_t * d, task_t task) {
+  pthread_mutex_lock(&d->m);
+  if (d->count == d->cap) {
+    sz cap = d->cap ? d->cap * 2 : 64;
+    task_t * ring = xmalloc(cap * sizeof(task_t));
+    Fi(d->count, ring[i] = d->ring[(d->head + i) % d->cap]);
+    free(d->ring);  d->ring = ring;  d->head = 0;  d->cap = cap;
+  }
+  d->ring[(d->head + d->count++) % d->cap] = task;
+  pthread_mutex_unlock(&d->m);
+}
+
+static bool take(deque_t * d, bool steal, task_t * task) {
+  bool got = false;
+  pthread_mutex_lock(&d->m);
+  if (d->count) {
+    got = true;  d->count--;
+    if (steal) *task = d->ring[d->head], d->head = (d->head + 1) % d->cap;
+    else *task = d->ring[(d->head + d->count) % d->cap];
+  }
+  pthread_mutex_unlock(&d->m);
+  return got;
+}
+
+static bool find(int t, task_t * task) {
+  if (take(&pinned[t], true, task) || take(&deques[t], false, task))
+    goto found;
+  Fi(nthreads - 1,
+    if (take(&deques[(t + i + 1) % nthreads], true, task)) goto found);
+  return false;
+found:
+  pthread_mutex_lock(&lock);  queued--;  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+// Passes every index of the finished prefix of the loop to `done'. Only one
+// thread does so at a time, without holding the lock.
+static void emit(job_t * j) {
+  j->emitting = true;
+  while (j->next < j->chunks && j->finished[j->next]) {
+    sz c = j->next;
+    pthread_mutex_unlock(&lock);
+    for (sz i = j->n * c / j->chunks; i < j->n * (c + 1) / j->chunks; i++)
+      j->done(j->ctx, i);
+    pthread_mutex_lock(&lock);
+    j->next++;
+  }
+  j->emitting = false;
+}
+
+static void run(task_t task) {
+  job_t * j = task.j;  sz c = task.c;
+  j->fn(j->ctx, j->n * c / j->chunks, j->n * (c + 1) / j->chunks);
+  pthread_mutex_lock(&lock);
+  j->left--;
+  if (j->done) {
+    j->finished[c] = true;
+    if (!j->emitting) emit(j);
+  }
+  // Once the lock is released after the last range, `j' may be gone.
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+static bool complete(job_t * j) {
+  return !j->left && !j->emitting && (!j->done || j->next == j->chunks);
+}
+
+static void * worker(void * arg) {
+  int t = (int) (intptr_t) arg;  task_t task;
+  pthread_setspecific(self_key, (void *) (intptr_t) (t + 1));
+  for (;;) {
+    if (find(t, &task)) { run(task); continue; }
+    pthread_mutex_lock(&lock);
+    if (!queued) pthread_cond_wait(&wake, &lock);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+static void pin(pthread_t thread, int t) {
+  #if defined(HAVE_SCHED_GETAFFINITY) && defined(HAVE_PTHREAD_SETAFFINITY_NP)
+  cpu_set_t all, one;  int seen = 0;
+  if (sched_getaffinity(0, sizeof(all), &all)) return;
+  int n = CPU_COUNT(&all);  if (!n) return;
+  CPU_ZERO(&one);
+  Fi(CPU_SETSIZE, if (CPU_ISSET(i, &all) && seen++ == t % n) CPU_SET(i, &one));
+  pthread_setaffinity_np(thread, sizeof(one), &one);
+  #else
+  (void) thread; (void) t;
+  #endif
+}
+
+int pool_cpus(void) {
+  int cpus = 0;
+  #if defined(HAVE_SCHED_GETAFFINITY)
+  cpu_set_t all;
+  if (!sched_getaffinity(0, sizeof(all), &all)) cpus = CPU_COUNT(&all);
+  #endif
+  #if defined(_SC_NPROCESSORS_ONLN)
+  if (cpus <= 0) cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  #endif
+  return cpus > 0 ? cpus : 1;
+}
+
+void pool_init(int threads, bool affinity) {
+  if (threads <= 0) threads = pool_cpus();
+  if (affinity) pin(pthread_self(), 0);
+  // Without the threads, loops simply run on the calling thread.
+  if (threads <= 1 || pthread_key_create(&self_key, NULL)) return;
+  deques = xmalloc(2 * threads * sizeof(deque_t));  pinned = deques + threads;
+  Fi(2 * threads,
+    deques[i].ring = NULL; deques[i].head = deques[i].count = deques[i].cap = 0;
+    pthread_mutex_init(&deques[i].m, NULL));
+  Fi0(threads, 1,
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, (void *) (intptr_t) i)) break;
+    pthread_detach(thread);
+    if (affinity) pin(thread, i);
+    nthreads = i + 1);
+}
+
+// Queues the ranges of `j' and runs ranges until all of `j' is done.
+static void run_job(job_t * j, bool pin) {
+  int t = self();  task_t task;
+  j->left = j->chunks;
+  pthread_mutex_lock(&lock);  queued += j->chunks;  pthread_mutex_unlock(&lock);
+  // In reverse, so that this thread starts from the beginning of the loop.
+  for (sz c = j->chunks; c-- > 0; )
+    push(pin ? &pinned[c] : &deques[t], (task_t) { j, c });
+  pthread_mutex_lock(&lock);
+  pthread_cond_broadcast(&wake);
+  while (!complete(j)) {
+    pthread_mutex_unlock(&lock);
+    if (find(t, &task)) run(task);
+    pthread_mutex_lock(&lock);
+    if (!complete(j) && !queued) pthread_cond_wait(&wake, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void start(sz n, sz grain, pool_fn fn, pool_done_fn done, void * ctx) {
+  job_t j = { fn, done, ctx, n, chunk_count(n, grain, nthreads), 0, 0,
+              false, NULL };
+  if (nthreads == 1 || j.chunks == 1) {
+    fn(ctx, 0, n);
+    if (done) for (sz i = 0; i < n; i++) done(ctx, i);
+    return;
+  }
+  if (done) j.finished = xmalloc(j.chunks), memset(j.finished, 0, j.chunks);
+  run_job(&j, false);
+  free(j.finished);
+}
+
+// Range c of the loop is queued for thread c.
+void pool_static(sz n, pool_fn fn, void * ctx) {
+  job_t j = { fn, NULL, ctx, n, MIN(n, (sz) nthreads), 0, 0, false, NULL };
+  if (j.chunks <= 1) { if (n) fn(ctx, 0, n);  return; }
+  run_job(&j, true);
+}
+
+void pool_add(int * p, int v) {
+  pthread_mutex_lock(&user_lock);  *p += v;  pthread_mutex_unlock(&user_lock);
+}
+void pool_lock(void) { pthread_mutex_lock(&user_lock); }
+void pool_unlock(void) { pthread_mutex_unlock(&user_lock); }
+#else
+int pool_cpus(void) { return 1; }
+void pool_init(int threads, bool affinity) { (void) threads; (void) affinity; }
+static void start(sz n, sz grain, pool_fn fn, pool_done_fn done, void * ctx) {
+  (void) grain;
+  fn(ctx, 0, n);
+  if (done) for (sz i = 0; i < n; i++) done(ctx, i);
+}
+void pool_static(sz n, pool_fn fn, void * ctx) { if (n) fn(ctx, 0, n); }
+void pool_add(int * p, int v) { *p += v; }
+void pool_lock(void) {}
+void pool_unlock(void) {}
+#endif
+
+int pool_threads(void) { return nthreads; }
+void pool_for(sz n, sz grain, pool_fn fn, void * ctx) {
+  if (n) start(n, grain, fn, NULL, ctx);
+}
+void pool_ordered(sz n, sz grain, pool_fn fn, pool_done_fn done, void * ctx) {
+  if (n) start(n, grain, fn, done, ctx);
+}
@@ -0,0 +1,56 @@
+/*
+   Copyright (C) 2022-2024 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "common.h"
+
+// ============================================================================
+//  Thread pool. Loops are split into ranges of iterations that are run by
+//  the pool threads and by the thread that started the loop. Loops may be
+//  started from inside other loops. Without thread support, or before
+//  pool_init, everything runs on the calling thread.
+// ============================================================================
+typedef void (*pool_fn)(void * ctx, sz lo, sz hi);
+typedef void (*pool_done_fn)(void * ctx, sz i);
+
+// `threads' <= 0 uses every available CPU. With `affinity', each thread is
+// pinned to a CPU of its own.
+void pool_init(int threads, bool affinity);
+// The number of CPUs available to the process.
+int pool_cpus(void);
+int pool_threads(void);
+// Runs `fn' over [0, n) in ranges of at least `grain' iterations; a grain
+// of `n' runs the loop serially. Returns once all of it is done.
+void pool_for(sz n, sz grain, pool_fn fn, void * ctx);
+// As above, and also calls `done' for every index, in increasing order and
+// one at a time, as soon as the ranges up to it have been run.
+void pool_ordered(sz n, sz grain, pool_fn fn, pool_done_fn done, void * ctx);
+// Runs `fn' over [0, n) in one range per thread, range i on thread i
+// whenever the loop is large enough, with no stealing. Loops over the same
+// buffer thus touch the same part of it from the same thread every time,
+// which keeps the memory on the NUMA node of that thread. For loops whose
+// iterations all cost about the same.
+void pool_static(sz n, pool_fn fn, void * ctx);
+// Adds `v' to `*p' atomically, for sums over the iterations of a loop.
+void pool_add(int * p, int v);
+// Guards short critical sections.
+void pool_lock(void);
+void pool_unlock(void);
+
+#endif
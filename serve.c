@@ -0,0 +1,254 @@
+/*
+   Copyright (C) 2022-2024 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "serve.h"
+#include "platform.h"
+#include "pool.h"
+
+#if defined(HAVE_SYS_UN_H) && defined(HAVE_FORK)
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
+  #include <errno.h>
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <signal.h>
+  #include <unistd.h>
+
+// ============================================================================
+//  Protocol. A request starts with the length of the command line as a
+//  4-byte big endian number, sent along with the descriptors of the standard
+//  input, output and error and of the working directory of the client. The
+//  command line follows, its arguments terminated by NUL characters. The
+//  reply is the exit status, as a 4-byte big endian number.
+// ============================================================================
+#define REQ_FDS 4
+#define REQ_MAX (1 << 20)
+
+static bool io_full(int fd, void * buf, sz len, bool rd) {
+  for (u8 * p = buf; len; ) {
+    ssize_t n = rd ? read(fd, p, len) : write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n, len -= n;
+  }
+  return true;
+}
+static void put_u32(u8 b[4], u32 v) { Fi(4, b[i] = v >> (24 - 8 * i)) }
+static u32 get_u32(u8 b[4]) {
+  return ((u32) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+static struct sockaddr_un socket_address(const char * path) {
+  struct sockaddr_un a;  memset(&a, 0, sizeof(a));
+  if (strlen(path) >= sizeof(a.sun_path)) FATAL("Socket path too long.");
+  a.sun_family = AF_UNIX;  strcpy(a.sun_path, path);
+  return a;
+}
+static bool send_request(int s, u8 len[4], int fds[REQ_FDS]) {
+  union { struct cmsghdr h; char b[CMSG_SPACE(REQ_FDS * sizeof(int))]; } u;
+  struct iovec v = { len, 4 };  struct msghdr m;
+  memset(&m, 0, sizeof(m));  memset(&u, 0, sizeof(u));
+  m.msg_iov = &v, m.msg_iovlen = 1;
+  m.msg_control = u.b, m.msg_controllen = sizeof(u.b);
+  struct cmsghdr * c = CMSG_FIRSTHDR(&m);
+  c->cmsg_level = SOL_SOCKET, c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(REQ_FDS * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, REQ_FDS * sizeof(int));
+  return sendmsg(s, &m, 0) == 4;
+}
+static bool recv_request(int s, u8 len[4], int fds[REQ_FDS]) {
+  union { struct cmsghdr h; char b[CMSG_SPACE(REQ_FDS * sizeof(int))]; } u;
+  struct iovec v = { len, 4 };  struct msghdr m;
+  memset(&m, 0, sizeof(m));
+  m.msg_iov = &v, m.msg_iovlen = 1;
+  m.msg_control = u.b, m.msg_controllen = sizeof(u.b);
+  if (recvmsg(s, &m, 0) != 4) return false;
+  struct cmsghdr * c = CMSG_FIRSTHDR(&m);
+  if (!c || c->cmsg_type != SCM_RIGHTS
+   || c->cmsg_len != CMSG_LEN(REQ_FDS * sizeof(int)))
+    return false;
+  memcpy(fds, CMSG_DATA(c), REQ_FDS * sizeof(int));
+  return true;
+}
+
+// ============================================================================
+//  Server. Every connection is handled by a process of its own, which runs
+//  the job in another process so that fatal errors only end the job, and
+//  reports its exit status once it is done.
+// ============================================================================
+static int serve_request(int c, int jobs, serve_fn run) {
+  u8 b[4];  int fds[REQ_FDS], w, status = 1;
+  if (!recv_request(c, b, fds)) return 1;
+  sz len = get_u32(b);  char * args = NULL, ** argv;  int argc = 0;
+  if (len <= REQ_MAX) args = xmalloc(len + 1);
+  if (!args || !io_full(c, args, len, true)) return 1;
+  args[len] = '\0';
+  Fi(len, argc += !args[i])
+  argv = xmalloc((argc + 1) * sizeof(char *));  argv[argc] = NULL;
+  for (sz i = 0, a = 0; a < (sz) argc; i += strlen(args + i) + 1)
+    argv[a++] = args + i;
+  pid_t pid = fork();
+  if (!pid) {
+    close(c);
+    Fi(3, if (dup2(fds[i], i) == -1) _exit(1))
+    if (fchdir(fds[3])) _exit(1);
+    Fi(REQ_FDS, close(fds[i]))
+    exit(run(argc, argv, jobs));
+  }
+  Fi(REQ_FDS, close(fds[i]))
+  if (pid != -1 && waitpid(pid, &w, 0) == pid)
+    status = WIFEXITED(w) ? WEXITSTATUS(w) : 128 + WTERMSIG(w);
+  put_u32(b, status);
+  return io_full(c, b, 4, false) ? 0 : 1;
+}
+// Threads are handed out from the budget of the server as jobs start and
+// taken back as they are reaped, so that the jobs never hold more threads
+// than the budget between them. A job is given half of the threads that are
+// free, at least one, and none start while all threads are held.
+typedef struct { pid_t pid; int threads; } child_t;
+static int chld_pipe[2];
+static void on_chld(int sig) {
+  (void) sig;  int e = errno;
+  if (write(chld_pipe[1], "", 1) < 0) { /* Already woken. */ }
+  errno = e;
+}
+static void reap(child_t * ch, int jobs, int * idle) {
+  for (pid_t pid; (pid = waitpid(-1, NULL, WNOHANG)) > 0; )
+    Fi(jobs, if (ch[i].pid == pid) { *idle += ch[i].threads; ch[i].pid = 0; })
+}
+// Only requests from the user running the server are served: a request
+// names files to create, overwrite and repair, which the server must not do
+// on behalf of anybody else.
+static bool peer_is_owner(int c) {
+#if defined(SO_PEERCRED)
+  struct ucred u;  socklen_t len = sizeof(u);
+  if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &u, &len)) return false;
+  return u.uid == geteuid() && u.gid == getegid();
+#elif defined(HAVE_GETPEEREID)
+  uid_t uid;  gid_t gid;
+  if (getpeereid(c, &uid, &gid)) return false;
+  return uid == geteuid() && gid == getegid();
+#else
+  (void) c;  return false;
+#endif
+}
+// The socket is only accessible to its owner. A socket left behind by an
+// earlier server is replaced when it is ours and no server answers on it;
+// other files are not, and bind never replaces a file.
+static void bind_socket(int s, const char * path) {
+  struct sockaddr_un a = socket_address(path);  struct stat st;
+  mode_t mask = umask(077);
+  int r = bind(s, (struct sockaddr *) &a, sizeof(a));
+  if (r && errno == EADDRINUSE) {
+    if (lstat(path, &st) || !S_ISSOCK(st.st_mode) || st.st_uid != geteuid())
+      FATAL("`%s' exists and is not a socket of ours.", path);
+    int t = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (t != -1 && !connect(t, (struct sockaddr *) &a, sizeof(a)))
+      FATAL("A server is already listening on `%s'.", path);
+    if (t != -1) close(t);
+    unlink(path);  r = bind(s, (struct sockaddr *) &a, sizeof(a));
+  }
+  umask(mask);
+  if (r) FATAL_PERROR("bind");
+}
+void xpar_serve(const char * path, int jobs, serve_fn run) {
+#if !defined(SO_PEERCRED) && !defined(HAVE_GETPEEREID)
+  FATAL("Daemon mode is not supported on this platform.");
+#endif
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == -1) FATAL_PERROR("socket");
+  bind_socket(s, path);
+  if (listen(s, 64)) FATAL_PERROR("listen");
+  // Children are reaped as soon as they exit: the handler wakes up poll.
+  if (pipe(chld_pipe)) FATAL_PERROR("pipe");
+  Fi(2, fcntl(chld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(chld_pipe[i], F_SETFD, FD_CLOEXEC))
+  struct sigaction sa;  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_chld, sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL)) FATAL_PERROR("sigaction");
+  signal(SIGPIPE, SIG_IGN);
+  if (jobs <= 0) jobs = pool_cpus();
+  child_t * ch = xmalloc(jobs * sizeof(child_t));  int idle = jobs;
+  Fi(jobs, ch[i].pid = 0)
+  for (;;) {
+    reap(ch, jobs, &idle);
+    struct pollfd pf[2] = { { chld_pipe[0], POLLIN, 0 }, { s, POLLIN, 0 } };
+    // With no threads to hand out, connections wait in the backlog.
+    if (poll(pf, idle ? 2 : 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      FATAL_PERROR("poll");
+    }
+    if (pf[0].revents) { char b[64];  while (read(chld_pipe[0], b, 64) > 0); }
+    if (!idle || !(pf[1].revents & POLLIN)) continue;
+    int c = accept(s, NULL, NULL);
+    if (c == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      FATAL_PERROR("accept");
+    }
+    if (!peer_is_owner(c)) {
+      fputs("Refused a request from another user.\n", stderr);
+      close(c);  continue;
+    }
+    int share = (idle + 1) / 2;
+    pid_t pid = fork();
+    if (!pid) {
+      close(s), close(chld_pipe[0]), close(chld_pipe[1]);
+      signal(SIGCHLD, SIG_DFL);
+      _exit(serve_request(c, share, run));
+    }
+    if (pid == -1) perror("fork");
+    else Fi(jobs, if (!ch[i].pid) { ch[i] = (child_t) { pid, share };
+                                    idle -= share;  break; })
+    close(c);
+  }
+}
+
+// ============================================================================
+//  Client.
+// ============================================================================
+int xpar_client(const char * path, int argc, char * argv[]) {
+  struct sockaddr_un a = socket_address(path);
+  sz len = 0;  u8 b[4];
+  Fi(argc, len += strlen(argv[i]) + 1)
+  if (len > REQ_MAX) FATAL("Command line too long.");
+  char * args = xmalloc(len), * p = args;
+  Fi(argc, strcpy(p, argv[i]); p += strlen(argv[i]) + 1)
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == -1) FATAL_PERROR("socket");
+  if (connect(s, (struct sockaddr *) &a, sizeof(a))) FATAL_PERROR("connect");
+  int fds[REQ_FDS] = { 0, 1, 2, open(".", O_RDONLY) };
+  if (fds[3] == -1) FATAL_PERROR("open");
+  signal(SIGPIPE, SIG_IGN);
+  put_u32(b, len);
+  if (!send_request(s, b, fds) || !io_full(s, args, len, false))
+    FATAL("Failed to send the request.");
+  if (!io_full(s, b, 4, true)) FATAL("The server closed the connection.");
+  close(s), close(fds[3]), free(args);
+  return get_u32(b);
+}
+#else
+void xpar_serve(const char * path, int jobs, serve_fn run) {
+  (void) path; (void) jobs; (void) run;
+  FATAL("Daemon mode is not supported on this platform.");
+}
+int xpar_client(const char * path, int argc, char * argv[]) {
+  (void) path; (void) argc; (void) argv;
+  FATAL("Daemon mode is not supported on this platform.");
+}
+#endif
@@ -0,0 +1,39 @@
+/*
+   Copyright (C) 2022-2024 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include "common.h"
+
+// ============================================================================
+//  Daemon mode. A long-lived server accepts requests on a Unix socket, each
+//  being a command line to run along with the standard streams and working
+//  directory of the client, and replies with the exit status. Requests run
+//  in processes forked from the server, so the tables are generated once,
+//  and the threads held by the jobs never exceed the budget of the server.
+//  The thread pool and the lace buffers belong to the job and do not outlive
+//  it: only the start-up of the program is saved.
+// ============================================================================
+// Runs a command line with the given number of threads, returns its status.
+typedef int (*serve_fn)(int argc, char * argv[], int jobs);
+// Serves requests on the socket at `path' forever, `jobs' threads at most.
+void xpar_serve(const char * path, int jobs, serve_fn run);
+// Sends a command line to the server at `path', returns its exit status.
+int xpar_client(const char * path, int argc, char * argv[]);
+
+#endif
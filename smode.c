@@ -18,15 +18,17 @@
 #include "smode.h"
 #include "crc32c.h"
 #include "platform.h"
+#include "pool.h"
 
 #include <assert.h>
 #include <sys/stat.h>
 
-#if defined(XPAR_OPENMP)
-  #include <omp.h>
-#endif
-
 static u8 LOG[256], EXP[256], PROD[256][256];
+// For every constant: its products with the 16 values of the low and of the
+// high nibble of a byte, and the 8x8 bit matrix of the multiplication by it
+// (row i, giving bit i of the product, in byte 7 - i), for the vector
+// multiply-accumulate kernels.
+static u8 PROD_NIB[256][48];
 void smode_gf256_gentab(u8 poly) {
   for (int l = 0, b = 1; l < 255; l++) {
     LOG[b] = l;  EXP[l] = b;
@@ -36,6 +38,10 @@ void smode_gf256_gentab(u8 poly) {
   for (int i = 1; i < 256; i++)
     for (int j = 1; j < 256; j++)
       PROD[i][j] = EXP[(LOG[i] + LOG[j]) % 255];
+  for (int a = 0; a < 256; a++) {
+    Fi(16, PROD_NIB[a][i] = PROD[a][i]; PROD_NIB[a][16 + i] = PROD[a][i << 4])
+    Fi(8, Fj(8, PROD_NIB[a][32 + 7 - i] |= ((PROD[a][1 << j] >> i) & 1) << j))
+  }
 }
 static u8 gf256_div(u8 a, u8 b) {
   if (!a || !b) return 0;
@@ -156,20 +162,88 @@ static rs * rs_init(int data_shards, int parity_shards) {
   Fi(parity_shards, r->rows[i] = r->matrix->v[data_shards + i])
   return r;
 }
+// ============================================================================
+//  Multiply-accumulate: dst ^= a * b over a whole shard, the inner loop of
+//  encoding and correction. The bulk of the shard, in multiples of 64 bytes,
+//  goes through a vector kernel where one is available.
+// ============================================================================
+#if defined(XPAR_X86_64)
+#ifdef HAVE_FUNC_ATTRIBUTE_SYSV_ABI
+  #define EXTERNAL_ABI __attribute__((sysv_abi))
+#else
+  #define EXTERNAL_ABI
+#endif
+
+extern EXTERNAL_ABI int xpar_x86_64_cpuflags(void);
+extern EXTERNAL_ABI void gf256_prod_x86_64_ssse3(u8 *, u8 *, sz, u8 *);
+extern EXTERNAL_ABI void gf256_prod_x86_64_avx2(u8 *, u8 *, sz, u8 *);
+extern EXTERNAL_ABI void gf256_prod_x86_64_gfni(u8 *, u8 *, sz, u8 *);
+#elif defined(XPAR_AARCH64)
+extern void gf256_prod_aarch64_neon(u8 *, u8 *, sz, u8 *);
+#endif
+
 static void gf256_prod(uint8_t * restrict dst, uint8_t a,
                        uint8_t * restrict b, size_t len) {
-  for (int i = 0; i < len; i++)
+  size_t i = 0;
+  if (!a) return;
+#if defined(XPAR_X86_64)
+  static int cpuflags = -1;
+  if (cpuflags == -1) cpuflags = xpar_x86_64_cpuflags();
+  size_t n = len & ~(size_t) 63;
+  if (n) {
+    // Bit 7 is GFNI support, bit 5 AVX2 support, bit 6 SSSE3 support.
+    u8 * t = PROD_NIB[a];
+    if ((cpuflags & 0x84) == 0x84) gf256_prod_x86_64_gfni(dst, b, n, t);
+    else if (cpuflags & 0x20) gf256_prod_x86_64_avx2(dst, b, n, t);
+    else if (cpuflags & 0x40) gf256_prod_x86_64_ssse3(dst, b, n, t);
+    else n = 0;
+    i = n;
+  }
+#elif defined(XPAR_AARCH64)
+  size_t n = len & ~(size_t) 63;
+  if (n) gf256_prod_aarch64_neon(dst, b, n, PROD_NIB[a]), i = n;
+#endif
+  for (; i < len; i++)
     dst[i] ^= PROD[a][b[i]];
 }
+// Only worth spreading between threads for many large shards.
+static sz rs_grain(rs * r, size_t len, sz n) {
+  return (r->data + r->parity) > 8 && len > 100 * 1024 * 1024 ? 1 : n;
+}
+typedef struct {
+  rs * r;  uint8_t ** in, ** shards, * present;  gf256mat * inv;
+  size_t len, tile;
+} rs_job;
+// Encoding goes tile by tile across the shards: each tile of the data shards
+// is read from memory once and accumulated into the tiles of all the parity
+// shards while it is in the cache, instead of streaming all the data once
+// per parity shard. The parity tiles of one data tile fit in RS_TILE_CACHE.
+// Tiles are multiples of 64 bytes, so that gf256_prod covers them with the
+// vector kernels, and ranges of tiles are spread between threads.
+#define RS_TILE_CACHE (192 << 10)
+static void rs_encode_tiles(void * ctx, sz lo, sz hi) {
+  rs_job * c = ctx;  rs * r = c->r;
+  for (sz t = lo; t < hi; t++) {
+    size_t off = t * c->tile, n = MIN(c->tile, c->len - off);
+    Fj(r->parity, memset(c->in[r->data + j] + off, 0, n))
+    Fk(r->data, Fj(r->parity,
+      gf256_prod(c->in[r->data + j] + off, r->rows[j][k], c->in[k] + off, n)))
+  }
+}
 static void rs_encode(rs * r, uint8_t ** in, size_t len) {
-  for (int j = 0; j < r->parity; j++)
-    memset(in[r->data + j], 0, len);
-#if defined(XPAR_OPENMP)
-  #pragma omp parallel for if((r->data + r->parity) > 8 && len > 100 * 1024 * 1024)
-#endif
-  for (int j = 0; j < r->parity; j++)
-    for (int k = 0; k < r->data; k++)
-      gf256_prod(in[r->data + j], r->rows[j][k], in[k], len);
+  rs_job c = { .r = r, .in = in, .len = len };
+  c.tile = RS_TILE_CACHE / (r->parity + 1) & ~(size_t) 63;
+  // At least a megabyte of shard data per range of tiles.
+  sz tiles = (len + c.tile - 1) / c.tile;
+  sz grain = (1 << 20) / (c.tile * r->total);
+  pool_for(tiles, grain ? grain : 1, rs_encode_tiles, &c);
+}
+static void rs_correct_rows(void * ctx, sz lo, sz hi) {
+  rs_job * c = ctx;
+  for (sz i = lo; i < hi; i++)
+    for (int j = 0; j < c->r->data; j++)
+      if (!c->present[i])
+        gf256_prod(c->in[i], c->inv->v[j][i], c->shards[j], c->len);
 }
 static bool rs_correct(rs * r, uint8_t ** in, uint8_t * shards_present, size_t len) {
   int present = 0;
@@ -190,12 +264,9 @@ static bool rs_correct(rs * r, uint8_t ** in, uint8_t * shards_present, size_t l
   if (!inv) return false;
   gf256mat_trans(inv);
 
-#if defined(XPAR_OPENMP)
-  #pragma omp parallel for if((r->data + r->parity) > 8 && len > 100 * 1024 * 1024)
-#endif
-  for (int i = 0; i < r->data; i++)
-    for (int j = 0; j < r->data; j++)
-      if(!shards_present[i]) gf256_prod(in[i], inv->v[j][i], shards[j], len);
+  rs_job c = { .r = r, .in = in, .shards = shards, .present = shards_present,
+               .inv = inv, .len = len };
+  pool_for(r->data, rs_grain(r, len, r->data), rs_correct_rows, &c);
   gf256mat_free(inv);  free(shards);
   return true;
 }
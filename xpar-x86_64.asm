@@ -16,7 +16,8 @@
 section .text
 
 ; =============================================================================
-;  MacOS likes leading underscores in symbol names. Please it.
+;  MacOS likes leading underscores in symbol names. Please it. ELF objects
+;  keep the symbols hidden, so that only the API of libxpar is exported.
 ; =============================================================================
 %ifdef MACHO
   global _xpar_x86_64_cpuflags
@@ -24,6 +25,11 @@ section .text
   global _rse32_x86_64_generic
   global _rse32_x86_64_avx512
   global _crc32c_32k_x86_64_sse42
+  global _crc32c_fold_x86_64_avx512
+  global _crc32c_fold_x86_64_avx2
+  global _gf256_prod_x86_64_ssse3
+  global _gf256_prod_x86_64_avx2
+  global _gf256_prod_x86_64_gfni
   extern _PROD_GEN
 
   %define xpar_x86_64_cpuflags _xpar_x86_64_cpuflags
@@ -32,12 +38,34 @@ section .text
   %define rse32_x86_64_avx512 _rse32_x86_64_avx512
   %define PROD_GEN _PROD_GEN
   %define crc32c_32k_x86_64_sse42 _crc32c_32k_x86_64_sse42
+  %define crc32c_fold_x86_64_avx512 _crc32c_fold_x86_64_avx512
+  %define crc32c_fold_x86_64_avx2 _crc32c_fold_x86_64_avx2
+  %define gf256_prod_x86_64_ssse3 _gf256_prod_x86_64_ssse3
+  %define gf256_prod_x86_64_avx2 _gf256_prod_x86_64_avx2
+  %define gf256_prod_x86_64_gfni _gf256_prod_x86_64_gfni
+%elifdef ELF
+  global xpar_x86_64_cpuflags:function hidden
+  global crc32c_small_x86_64_sse42:function hidden
+  global rse32_x86_64_generic:function hidden
+  global rse32_x86_64_avx512:function hidden
+  global crc32c_32k_x86_64_sse42:function hidden
+  global crc32c_fold_x86_64_avx512:function hidden
+  global crc32c_fold_x86_64_avx2:function hidden
+  global gf256_prod_x86_64_ssse3:function hidden
+  global gf256_prod_x86_64_avx2:function hidden
+  global gf256_prod_x86_64_gfni:function hidden
+  extern PROD_GEN
 %else
   global xpar_x86_64_cpuflags
   global crc32c_small_x86_64_sse42
   global rse32_x86_64_generic
   global rse32_x86_64_avx512
   global crc32c_32k_x86_64_sse42
+  global crc32c_fold_x86_64_avx512
+  global crc32c_fold_x86_64_avx2
+  global gf256_prod_x86_64_ssse3
+  global gf256_prod_x86_64_avx2
+  global gf256_prod_x86_64_gfni
   extern PROD_GEN
 %endif
 
@@ -58,9 +86,11 @@ section .text
 
 ; =============================================================================
 ;  Probe the CPU features, keeping in mind that the OS can disable
-;  AVX512F and AVX512VL support. The return value is a bitfield:
+;  AVX and AVX512 support. The return value is a bitfield:
 ;  rax & (1 << 0) - SSE4.2 support.    rax & (1 << 1) - PCLMULQDQ support.
 ;  rax & (1 << 2) - AVX512F support.   rax & (1 << 3) - AVX512VL support.
+;  rax & (1 << 4) - VPCLMULQDQ support. rax & (1 << 5) - AVX2 support.
+;  rax & (1 << 6) - SSSE3 support.     rax & (1 << 7) - GFNI support.
 ; =============================================================================
 xpar_x86_64_cpuflags:
   push rbx
@@ -73,11 +103,16 @@ xpar_x86_64_cpuflags:
   mov esi, ecx
   and esi, 0x02
   or esi, eax
+  mov eax, ecx
+  shr eax, 3
+  and eax, 0x40
+  or esi, eax
   not ecx
   test ecx, 0x18000000
   jne .no_osxsave
   xor ecx, ecx
   xgetbv
+  mov r8d, eax
   not eax
   test al, 0x06
   jne .no_osxsave
@@ -87,9 +122,24 @@ xpar_x86_64_cpuflags:
   mov eax, ebx
   shr eax, 14
   and eax, 0x04
+  mov edx, ebx
+  and edx, 0x20
+  or eax, edx
+  mov edx, ecx
+  shr edx, 1
+  and edx, 0x80
+  or eax, edx
+  shr ecx, 6
+  and ecx, 0x10
+  or eax, ecx
   shr ebx, 31
   lea eax, [rax + 8 * rbx]
   or esi, eax
+  ; The ZMM registers and the mask registers need saving by the OS as well.
+  not r8d
+  test r8b, 0xE0
+  je .no_osxsave
+  and esi, ~0x0C
 .no_osxsave:
   mov eax, esi
   pop rbx
@@ -250,6 +300,154 @@ crc32c_32k_x86_64_sse42:
 ;  TO-DO: 3-way saturating CRC32C + concurrent PCMULQDQ fusion
 ;         implementation for 2MB blocks based on Peter Cawley's ideas.
 
+; =============================================================================
+;  Folding CRC32C for large buffers, which the CRC32 instruction alone can do
+;  at about 8 bytes per cycle at best. Four vector accumulators, each holding
+;  128-bit lanes, are multiplied with VPCLMULQDQ by x^D mod P and added to
+;  the data D bits further on, so that they keep a remainder of the data
+;  read so far. The accumulators are then folded into one 128-bit value
+;  whose CRC is that of all the data, computed with the CRC32 instruction.
+;  The constants are x^(D+32) and x^(D-32) mod P, bit-reflected and shifted
+;  left by one, to multiply the low and the high quadword of a lane with.
+;  Defers to `crc32c_small_x86_64_sse42' for leftover.
+; =============================================================================
+align 64
+crc32c_fold_lanes:
+  dq 0x000000001c291d04, 0x00000001d82c63da ; D = 384.
+  dq 0x00000001384aa63a, 0x00000000ba4fc28e ; D = 256.
+  dq 0x00000000f20c0dfe, 0x000000014cd00bd6 ; D = 128.
+  dq 0, 0
+crc32c_fold_k:
+  dq 0x00000000dcb17aa4, 0x00000000b9e02b86 ; D = 2048.
+  dq 0x000000006992cea2, 0x000000000d3b6092 ; D = 1024.
+  dq 0x00000000740eef02, 0x000000009e4addf8 ; D = 512.
+  dq 0x00000001384aa63a, 0x00000000ba4fc28e ; D = 256.
+
+; Requires AVX512F and VPCLMULQDQ. Folds 256 bytes at a time.
+crc32c_fold_x86_64_avx512:
+  cmp rdx, 256
+  jb .fold512_small
+  vmovd xmm4, edi
+  vpxorq zmm0, zmm4, [rsi]
+  vmovdqu64 zmm1, [rsi + 64]
+  vmovdqu64 zmm2, [rsi + 128]
+  vmovdqu64 zmm3, [rsi + 192]
+  vbroadcasti32x4 zmm4, [rel crc32c_fold_k]
+  add rsi, 256
+  sub rdx, 256
+.fold512_loop:
+  cmp rdx, 256
+  jb .fold512_merge
+  vpclmulqdq zmm5, zmm0, zmm4, 0x00
+  vpclmulqdq zmm0, zmm0, zmm4, 0x11
+  vpternlogq zmm0, zmm5, [rsi], 0x96
+  vpclmulqdq zmm5, zmm1, zmm4, 0x00
+  vpclmulqdq zmm1, zmm1, zmm4, 0x11
+  vpternlogq zmm1, zmm5, [rsi + 64], 0x96
+  vpclmulqdq zmm5, zmm2, zmm4, 0x00
+  vpclmulqdq zmm2, zmm2, zmm4, 0x11
+  vpternlogq zmm2, zmm5, [rsi + 128], 0x96
+  vpclmulqdq zmm5, zmm3, zmm4, 0x00
+  vpclmulqdq zmm3, zmm3, zmm4, 0x11
+  vpternlogq zmm3, zmm5, [rsi + 192], 0x96
+  add rsi, 256
+  sub rdx, 256
+  jmp .fold512_loop
+.fold512_merge:
+  vbroadcasti32x4 zmm4, [rel crc32c_fold_k + 32]
+  vpclmulqdq zmm5, zmm0, zmm4, 0x00
+  vpclmulqdq zmm0, zmm0, zmm4, 0x11
+  vpternlogq zmm1, zmm0, zmm5, 0x96
+  vpclmulqdq zmm5, zmm1, zmm4, 0x00
+  vpclmulqdq zmm1, zmm1, zmm4, 0x11
+  vpternlogq zmm2, zmm1, zmm5, 0x96
+  vpclmulqdq zmm5, zmm2, zmm4, 0x00
+  vpclmulqdq zmm2, zmm2, zmm4, 0x11
+  vpternlogq zmm3, zmm2, zmm5, 0x96
+  ; The last lane is not multiplied, only added.
+  vmovdqu64 zmm4, [rel crc32c_fold_lanes]
+  vpclmulqdq zmm5, zmm3, zmm4, 0x00
+  vpclmulqdq zmm0, zmm3, zmm4, 0x11
+  vpxorq zmm0, zmm0, zmm5
+  vextracti32x4 xmm1, zmm3, 3
+  vextracti64x4 ymm5, zmm0, 1
+  vpxor ymm0, ymm0, ymm5
+  vextracti128 xmm5, ymm0, 1
+  vpxor xmm0, xmm0, xmm5
+  vpxor xmm0, xmm0, xmm1
+  vmovq rax, xmm0
+  vpextrq rcx, xmm0, 1
+  vzeroupper
+  xor edi, edi
+  crc32 rdi, rax
+  crc32 rdi, rcx
+.fold512_small:
+  jmp crc32c_small_x86_64_sse42
+
+; Requires AVX2 and VPCLMULQDQ. Folds 128 bytes at a time.
+crc32c_fold_x86_64_avx2:
+  cmp rdx, 128
+  jb .fold256_small
+  vmovd xmm4, edi
+  vpxor ymm0, ymm4, [rsi]
+  vmovdqu ymm1, [rsi + 32]
+  vmovdqu ymm2, [rsi + 64]
+  vmovdqu ymm3, [rsi + 96]
+  vbroadcasti128 ymm4, [rel crc32c_fold_k + 16]
+  add rsi, 128
+  sub rdx, 128
+.fold256_loop:
+  cmp rdx, 128
+  jb .fold256_merge
+  vpclmulqdq ymm5, ymm0, ymm4, 0x00
+  vpclmulqdq ymm0, ymm0, ymm4, 0x11
+  vpxor ymm0, ymm0, [rsi]
+  vpxor ymm0, ymm0, ymm5
+  vpclmulqdq ymm5, ymm1, ymm4, 0x00
+  vpclmulqdq ymm1, ymm1, ymm4, 0x11
+  vpxor ymm1, ymm1, [rsi + 32]
+  vpxor ymm1, ymm1, ymm5
+  vpclmulqdq ymm5, ymm2, ymm4, 0x00
+  vpclmulqdq ymm2, ymm2, ymm4, 0x11
+  vpxor ymm2, ymm2, [rsi + 64]
+  vpxor ymm2, ymm2, ymm5
+  vpclmulqdq ymm5, ymm3, ymm4, 0x00
+  vpclmulqdq ymm3, ymm3, ymm4, 0x11
+  vpxor ymm3, ymm3, [rsi + 96]
+  vpxor ymm3, ymm3, ymm5
+  add rsi, 128
+  sub rdx, 128
+  jmp .fold256_loop
+.fold256_merge:
+  vbroadcasti128 ymm4, [rel crc32c_fold_k + 48]
+  vpclmulqdq ymm5, ymm0, ymm4, 0x00
+  vpclmulqdq ymm0, ymm0, ymm4, 0x11
+  vpxor ymm1, ymm1, ymm0
+  vpxor ymm1, ymm1, ymm5
+  vpclmulqdq ymm5, ymm1, ymm4, 0x00
+  vpclmulqdq ymm1, ymm1, ymm4, 0x11
+  vpxor ymm2, ymm2, ymm1
+  vpxor ymm2, ymm2, ymm5
+  vpclmulqdq ymm5, ymm2, ymm4, 0x00
+  vpclmulqdq ymm2, ymm2, ymm4, 0x11
+  vpxor ymm3, ymm3, ymm2
+  vpxor ymm3, ymm3, ymm5
+  ; As above, with the constants of the last two lanes.
+  vmovdqu ymm4, [rel crc32c_fold_lanes + 32]
+  vpclmulqdq ymm5, ymm3, ymm4, 0x00
+  vpclmulqdq ymm0, ymm3, ymm4, 0x11
+  vpxor xmm0, xmm0, xmm5
+  vextracti128 xmm1, ymm3, 1
+  vpxor xmm0, xmm0, xmm1
+  vmovq rax, xmm0
+  vpextrq rcx, xmm0, 1
+  vzeroupper
+  xor edi, edi
+  crc32 rdi, rax
+  crc32 rdi, rcx
+.fold256_small:
+  jmp crc32c_small_x86_64_sse42
+
 ; =============================================================================
 ;  Reed-Solomon encoder is basically a shift register. Here, we observe
 ;  that compilers are generally very bad at optimising this kind of pattern.
@@ -392,6 +590,88 @@ rse32_x86_64_avx512:
   ret        ;     does, I will find you, and it will not end well for you.
 ; Unlike some people say, this is still necessary on AVX512 CPUs.
 
+; =============================================================================
+;  Multiply-accumulate over a shard: dst[i] ^= a * src[i] in GF(2^8), for
+;  the sharded mode. rdi = dst, rsi = src, rdx = length (a non-zero multiple
+;  of 64), rcx = the tables for `a': the products of `a' with the 16 values
+;  of the low nibble, those with the 16 values of the high nibble, and an
+;  8x8 bit matrix of the multiplication by `a'. The PSHUFB kernels look up
+;  the products of both nibbles of each byte and xor them. The GFNI kernel
+;  applies the matrix directly, and thus works for any field polynomial,
+;  unlike GF2P8MULB.
+; =============================================================================
+gf256_prod_x86_64_ssse3:
+  movdqu xmm0, [rcx]
+  movdqu xmm1, [rcx + 16]
+  mov eax, 0x0F0F0F0F
+  movd xmm2, eax
+  pshufd xmm2, xmm2, 0
+  xor eax, eax
+.gf256_ssse3_loop:
+  movdqu xmm3, [rsi + rax]
+  movdqa xmm4, xmm3
+  psrlw xmm4, 4
+  pand xmm3, xmm2
+  pand xmm4, xmm2
+  movdqa xmm5, xmm0
+  pshufb xmm5, xmm3
+  movdqa xmm3, xmm1
+  pshufb xmm3, xmm4
+  pxor xmm3, xmm5
+  movdqu xmm4, [rdi + rax]
+  pxor xmm3, xmm4
+  movdqu [rdi + rax], xmm3
+  add rax, 16
+  cmp rax, rdx
+  jne .gf256_ssse3_loop
+  ret
+
+gf256_prod_x86_64_avx2:
+  vbroadcasti128 ymm0, [rcx]
+  vbroadcasti128 ymm1, [rcx + 16]
+  mov eax, 0x0F
+  vmovd xmm2, eax
+  vpbroadcastb ymm2, xmm2
+  xor eax, eax
+.gf256_avx2_loop:
+  vmovdqu ymm3, [rsi + rax]
+  vmovdqu ymm5, [rsi + rax + 32]
+  vpsrlw ymm4, ymm3, 4
+  vpsrlw ymm6, ymm5, 4
+  vpand ymm3, ymm3, ymm2
+  vpand ymm4, ymm4, ymm2
+  vpand ymm5, ymm5, ymm2
+  vpand ymm6, ymm6, ymm2
+  vpshufb ymm3, ymm0, ymm3
+  vpshufb ymm4, ymm1, ymm4
+  vpshufb ymm5, ymm0, ymm5
+  vpshufb ymm6, ymm1, ymm6
+  vpxor ymm3, ymm3, ymm4
+  vpxor ymm5, ymm5, ymm6
+  vpxor ymm3, ymm3, [rdi + rax]
+  vpxor ymm5, ymm5, [rdi + rax + 32]
+  vmovdqu [rdi + rax], ymm3
+  vmovdqu [rdi + rax + 32], ymm5
+  add rax, 64
+  cmp rax, rdx
+  jne .gf256_avx2_loop
+  vzeroupper
+  ret
+
+gf256_prod_x86_64_gfni:
+  vpbroadcastq zmm0, [rcx + 32]
+  xor eax, eax
+.gf256_gfni_loop:
+  vmovdqu64 zmm1, [rsi + rax]
+  vgf2p8affineqb zmm1, zmm1, zmm0, 0
+  vpxorq zmm1, zmm1, [rdi + rax]
+  vmovdqu64 [rdi + rax], zmm1
+  add rax, 64
+  cmp rax, rdx
+  jne .gf256_gfni_loop
+  vzeroupper
+  ret
+
 ; Need .GNU-stack to mark the stack as non-executable on ELF targets.
 %ifdef ELF
   section .note.GNU-stack noalloc noexec nowrite progbits
@@ -19,6 +19,8 @@
 #include "common.h"
 #include "jmode.h"
 #include "smode.h"
+#include "pool.h"
+#include "serve.h"
 #include "platform.h"
 #include "crc32c.h"
 #include "yarg.h"
@@ -32,10 +34,6 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#if defined(XPAR_OPENMP)
-#include <omp.h>
-#endif
-
 // ============================================================================
 //  Command-line stub.
 // ============================================================================
@@ -55,6 +53,9 @@ static void help() {
     "Usage (joint mode):\n"
     "  xpar -Je/-Jd [...] <in>              (adds/removes .xpa in output)\n"
     "  xpar -Je/-Jd [...] <in> <out>        (produces <out>)\n"
+    "  xpar -Jt [...] <in>                  (verifies <in>)\n"
+    "  xpar -Jr [...] <in>                  (repairs <in> in place)\n"
+    "  xpar -Je/-Jt/-Jr --sidecar [...] <in> (parity kept in <in>.xps)\n"
     "Usage (sharded mode):\n"
     "  xpar -Se [...] <in>                  (produces <in>.xpa.XXX)\n"
     "  xpar -Se --out-prefix=# [...] <in>   (produces #.xpa.XXX)\n"
@@ -65,21 +66,33 @@ static void help() {
     "  -S,   --sharded      use the sharded mode\n"
     "  -e,   --encode       add parity bits to a specified file\n"
     "  -d,   --decode       recover the original data\n"
+    "  -t,   --test         verify the integrity of an archive\n"
+    "  -r,   --repair       repair an archive in place\n"
     "Options:\n"
     "  -h,   --help         display an usage overview\n"
     "  -f,   --force        force operation: ignore errors, overwrite files\n"
     "  -v,   --verbose      verbose mode (display more information)\n"
     "  -q,   --quiet        quiet mode (display less information)\n"
     "  -V,   --version      display version information\n"
+    "        --sync=#       sync written files: none, end (default), or\n"
+    "                       incremental[:N] (write back every N laces)\n"
 #if defined(XPAR_ALLOW_MAPPING)
     "        --no-mmap      unconditionally disable memory mapping\n"
 #endif
-#if defined(XPAR_OPENMP)
     "  -j #, --jobs=#       set the number of threads to use\n"
-#endif
+    "        --affinity     pin each thread to a CPU of its own\n"
+    "        --serve=#      serve requests on the Unix socket # (the tables\n"
+    "                       are shared, each request starts its own threads)\n"
+    "        --client=#     run the command on the server at # (goes first)\n"
     "Joint mode only:\n"
     "  -c,   --stdout       force writing to standard output\n"
     "  -i #, --interlace=#  change the interlacing setting (1,2,3)\n"
+    "        --append       encode only data appended since the last run\n"
+    "        --update       encode only laces changed since the last run\n"
+    "        --sidecar      keep the parity in a separate file (<in>.xps)\n"
+    "        --resume       save progress and continue an interrupted run\n"
+    "        --replica=#    decode damaged laces using a second copy\n"
+    "        --batch        encode many files (names on stdin if not given)\n"
     "Sharded mode encoding options:\n"
     "        --dshards=#    set the number of data shards (< 128)\n"
     "        --pshards=#    set the number of parity shards (< 64)\n"
@@ -96,29 +109,53 @@ static void help() {
     "Or contact the author: Kamila Szewczyk <k@iczelia.net>\n"
   );
 }
-enum mode_t { MODE_NONE, MODE_ENCODING, MODE_DECODING };
-int main(int argc, char * argv[]) {
-  jmode_gf256_gentab(0x87);  smode_gf256_gentab(0x87);
-  platform_init();
+// Reads a NUL-separated list of file names, as printed by `find -print0'.
+static char ** read_names(FILE * des, int * n) {
+  sz size = 0, cap = 4096;  char * buf = xmalloc(cap), ** names;
+  for (sz r; (r = xfread(buf + size, cap - size - 1, des)); )
+    if ((size += r) == cap - 1 && !(buf = realloc(buf, cap *= 2)))
+      FATAL_PERROR("realloc");
+  buf[size++] = '\0';  *n = 0;
+  names = xmalloc((size / 2 + 1) * sizeof(char *));
+  for (char * p = buf; p < buf + size; p += strlen(p) + 1)
+    if (*p) names[(*n)++] = p;
+  return names;
+}
+enum mode_t { MODE_NONE, MODE_ENCODING, MODE_DECODING, MODE_TESTING,
+              MODE_REPAIRING };
+// `served_jobs' is the number of threads given to a request by the server,
+// or zero when run from the command line.
+static int run(int argc, char * argv[], int served_jobs) {
   enum { FLAG_NO_MMAP = CHAR_MAX + 1, FLAG_DSHARDS, FLAG_PSHARDS,
-         FLAG_OUT_PREFIX };
+         FLAG_OUT_PREFIX, FLAG_APPEND, FLAG_UPDATE, FLAG_SIDECAR,
+         FLAG_RESUME, FLAG_REPLICA, FLAG_SYNC, FLAG_BATCH,
+         FLAG_AFFINITY, FLAG_SERVE };
   yarg_options opt[] = {
     { 'V', no_argument, "version" },
     { 'v', no_argument, "verbose" },
     { 'J', no_argument, "joint" },
     { 'S', no_argument, "sharded" },
-#if defined(XPAR_OPENMP)
     { 'j', required_argument, "jobs" },
-#endif
     { 'c', no_argument, "stdout" },
     { 'q', no_argument, "quiet" },
     { 'h', no_argument, "help" },
     { 'e', no_argument, "encode" },
     { 'd', no_argument, "decode" },
+    { 't', no_argument, "test" },
+    { 'r', no_argument, "repair" },
     { 'f', no_argument, "force" },
     { FLAG_DSHARDS, required_argument, "dshards" },
     { FLAG_PSHARDS, required_argument, "pshards" },
     { FLAG_OUT_PREFIX, required_argument, "out-prefix" },
+    { FLAG_APPEND, no_argument, "append" },
+    { FLAG_UPDATE, no_argument, "update" },
+    { FLAG_SIDECAR, no_argument, "sidecar" },
+    { FLAG_RESUME, no_argument, "resume" },
+    { FLAG_REPLICA, required_argument, "replica" },
+    { FLAG_SYNC, required_argument, "sync" },
+    { FLAG_BATCH, no_argument, "batch" },
+    { FLAG_AFFINITY, no_argument, "affinity" },
+    { FLAG_SERVE, required_argument, "serve" },
 #if defined(XPAR_ALLOW_MAPPING)
     { FLAG_NO_MMAP, no_argument, "no-mmap" },
 #endif
@@ -128,8 +165,11 @@ int main(int argc, char * argv[]) {
   yarg_settings settings = { .style = YARG_STYLE_UNIX, .dash_dash = true };
   bool verbose = false, quiet = false, force = false, force_stdout = false;
   bool no_map = false, joint = false, sharded = false;
+  bool append = false, update = false, sidecar = false, resume = false;
+  bool batch = false, affinity = false;
   int mode = MODE_NONE, interlacing = -1, dshards = -1, pshards = -1, jobs = -1;
-  const char * out_prefix = NULL;
+  int status = 0;
+  const char * out_prefix = NULL, * replica = NULL, * serve = NULL;
   yarg_result * res = yarg_parse(argc, argv, opt, settings);
   if (res->error) { fputs(res->error, stderr); exit(1); }
   for (int i = 0; i < res->argc; i++) {
@@ -153,6 +193,12 @@ int main(int argc, char * argv[]) {
       case 'd':
         if(mode == MODE_NONE) mode = MODE_DECODING;
         else goto opmode_conflict;  break;
+      case 't':
+        if(mode == MODE_NONE) mode = MODE_TESTING;
+        else goto opmode_conflict;  break;
+      case 'r':
+        if(mode == MODE_NONE) mode = MODE_REPAIRING;
+        else goto opmode_conflict;  break;
       case 'f': force = true; break;
       case 'c': force_stdout = true; break;
       case FLAG_NO_MMAP: no_map = true; break;
@@ -172,21 +218,71 @@ int main(int argc, char * argv[]) {
           FATAL("Invalid number of parity shards.");
         break;
       case FLAG_OUT_PREFIX: out_prefix = o.arg; break;
+      case FLAG_APPEND:
+        if (update) goto conflict;  append = true; break;
+      case FLAG_UPDATE:
+        if (append) goto conflict;  update = true; break;
+      case FLAG_SIDECAR: sidecar = true; break;
+      case FLAG_RESUME: resume = true; break;
+      case FLAG_REPLICA: replica = o.arg; break;
+      case FLAG_BATCH: batch = true; break;
+      case FLAG_AFFINITY: affinity = true; break;
+      case FLAG_SERVE: serve = o.arg; break;
+      case FLAG_SYNC:
+        if (!strcmp(o.arg, "none")) xset_sync(SYNC_NONE);
+        else if (!strcmp(o.arg, "end")) xset_sync(SYNC_END);
+        else if (!strncmp(o.arg, "incremental", 11)
+              && (!o.arg[11] || o.arg[11] == ':')) {
+          xset_sync(SYNC_INCREMENTAL);
+          if (o.arg[11] && atoi(o.arg + 12) <= 0)
+            FATAL("Invalid synchronisation interval.");
+          if (o.arg[11]) xset_sync_laces(atoi(o.arg + 12));
+        } else FATAL("Invalid synchronisation mode.");
+        break;
       default: exit(1); break;
       conflict: FATAL("Conflicting options.");
       opmode_conflict: FATAL("Multiple operation modes specified.");
     }
   }
-#if defined(XPAR_OPENMP)
-  if (jobs > 0) omp_set_num_threads(jobs);
-#endif
+  if (serve) {
+    if (served_jobs) FATAL("Requests can not start a server.");
+    if (mode != MODE_NONE || res->pos_argc)
+      FATAL("The server takes no other arguments.");
+    xpar_serve(serve, jobs, run);
+  }
+  // A request may ask for fewer threads than the server gives it, not more.
+  int threads = jobs != -1 ? jobs : served_jobs;
+  if (served_jobs && (threads <= 0 || threads > served_jobs))
+    threads = served_jobs;
+  pool_init(threads, affinity);
   if (mode == MODE_NONE)
     FATAL("No operation mode specified.");
   if (!joint && !sharded) joint = true;
   if (joint) {
     if (dshards != -1 || pshards != -1 || out_prefix)
       FATAL("Sharded mode options in joint mode.");
+    if ((append || update) && (mode != MODE_ENCODING || force_stdout))
+      FATAL("Archives can only be updated when encoding to a file.");
+    if (sidecar && (mode == MODE_DECODING || append || update))
+      FATAL("Sidecar files can only be created, verified and repaired.");
+    if (resume && (append || update || sidecar || force_stdout
+                || (mode != MODE_ENCODING && mode != MODE_DECODING)))
+      FATAL("Only encoding or decoding to a file can be resumed.");
+    if (replica && (mode != MODE_DECODING || sidecar))
+      FATAL("Replicas are only used when decoding.");
     if (interlacing == -1) interlacing = 1;
+    if (batch) {
+      if (mode != MODE_ENCODING || force_stdout || append || update
+       || sidecar || resume)
+        FATAL("Batch mode only encodes files to archives.");
+      joint_options_t options = {
+        .interlacing = interlacing, .force = force, .quiet = quiet,
+        .verbose = verbose, .no_map = no_map
+      };
+      int n = res->pos_argc;  char ** names = res->pos_args;
+      if (!n) names = read_names(stdin, &n);
+      return do_joint_batch(options, names, n);
+    }
     char * f1 = NULL, * f2 = NULL;
     switch (res->pos_argc) {
       case 0: break;
@@ -195,7 +291,13 @@ int main(int argc, char * argv[]) {
       default: FATAL("Too many positional arguments.");
     }
     char * input_file = NULL, * output_file = NULL;
-    if (f1) switch(mode) {
+    if (sidecar) {
+      // The data file is never written to, so it is always the first name.
+      if (!f1) FATAL("No input file specified.");
+      input_file = f1, output_file = f2;
+      if (!f2 && (mode != MODE_ENCODING || !force_stdout))
+        asprintf(&output_file, "%s.xps", f1);
+    } else if (f1) switch(mode) {
       case MODE_ENCODING:
         if (!f2) {
           input_file = f1;
@@ -215,18 +317,33 @@ int main(int argc, char * argv[]) {
           }
         } else input_file = f1, output_file = f2;
         break;
+      case MODE_TESTING: case MODE_REPAIRING:
+        if (f2) FATAL("Too many positional arguments.");
+        input_file = f1;
+        break;
     }
     joint_options_t options = {
       .input_name = input_file, .output_name = output_file,
       .interlacing = interlacing,
       .force = force, .quiet = quiet, .verbose = verbose,
-      .no_map = no_map
+      .no_map = no_map, .append = append,
+      .update = update, .resume = resume, .replica = replica
     };
     volatile struct timeval start, end;
     gettimeofday((struct timeval *) &start, NULL);
     switch(mode) {
-      case MODE_ENCODING: do_joint_encode(options); break;
+      case MODE_ENCODING:
+        if (sidecar) do_sidecar_encode(options);
+        else do_joint_encode(options);
+        break;
       case MODE_DECODING: do_joint_decode(options); break;
+      case MODE_TESTING:
+        status = sidecar ? do_sidecar_test(options) : do_joint_test(options);
+        break;
+      case MODE_REPAIRING:
+        status = sidecar ? do_sidecar_repair(options)
+                         : do_joint_repair(options);
+        break;
     }
     gettimeofday((struct timeval *) &end, NULL);
     if (verbose) {
@@ -236,8 +353,11 @@ int main(int argc, char * argv[]) {
     }
     if (output_file != f2) free(output_file);
   } else {
-    if (interlacing != -1 || force_stdout)
+    if (interlacing != -1 || force_stdout || append || update || sidecar
+     || resume || replica || batch)
       FATAL("Joint mode options in sharded mode.");
+    if (mode == MODE_TESTING || mode == MODE_REPAIRING)
+      FATAL("Verification and repair are only supported in joint mode.");
     volatile struct timeval start, end;
     gettimeofday((struct timeval *) &start, NULL);
     switch(mode) {
@@ -279,4 +399,16 @@ int main(int argc, char * argv[]) {
     }
   }
   yarg_destroy(res);
+  return status;
+}
+int main(int argc, char * argv[]) {
+  jmode_gf256_gentab(0x87);  smode_gf256_gentab(0x87);
+  platform_init();
+  // The rest of the command line is passed to the server as is.
+  if (argc > 1 && !strncmp(argv[1], "--client=", 9)) {
+    const char * path = argv[1] + 9;
+    argv[1] = argv[0];
+    return xpar_client(path, argc - 1, argv + 1);
+  }
+  return run(argc, argv, 0);
 }
@@ -0,0 +1,112 @@
+/*
+   Copyright (C) 2022-2024 Kamila Szewczyk
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XPAR_H_
+#define _XPAR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The API is all that libxpar exports; the rest is built hidden.
+#if defined(__GNUC__) && __GNUC__ >= 4
+  #define XPAR_API __attribute__((visibility("default")))
+#else
+  #define XPAR_API
+#endif
+
+// ============================================================================
+//  libxpar: streaming joint mode encoding and decoding. Data is fed to an
+//  encoder or a decoder in pieces of any size, and the output is passed to a
+//  callback as soon as it is produced, a lace at a time. The archives are
+//  the same as those of `xpar -Je'. Functions return XPAR_OK or one of the
+//  (negative) error codes below; after an error, a context only returns the
+//  same error. Contexts may be used from different threads, one at a time.
+// ============================================================================
+enum {
+  XPAR_OK = 0,
+  XPAR_EINVAL = -1,     // Invalid argument.
+  XPAR_ENOMEM = -2,     // Out of memory.
+  XPAR_EWRITE = -3,     // The output callback failed.
+  XPAR_EHEADER = -4,    // Not an archive, or a damaged block header.
+  XPAR_ECORRUPT = -5,   // Too many errors to correct in a lace.
+  XPAR_ECRC = -6,       // The data of a lace does not match its checksum.
+  XPAR_ETRUNCATED = -7, // The archive ends in the middle of a lace.
+  XPAR_ETRAILER = -8,   // The trailer does not match the archive.
+  XPAR_ESTATE = -9,     // The context was already finished.
+  XPAR_ESPACE = -10     // The output buffer is too small.
+};
+// Returns a description of an error code.
+XPAR_API const char * xpar_strerror(int code);
+// Runs the codewords of a lace on `threads' threads (all CPUs if zero or
+// less) from now on. Only the first call has any effect.
+XPAR_API void xpar_set_threads(int threads);
+
+// Receives `len' bytes of output. Returns zero on success.
+typedef int (*xpar_write_fn)(void * opaque, const uint8_t * buf, size_t len);
+
+typedef struct xpar_enc xpar_enc;
+// `interlacing' is 1, 2 or 3, as with `xpar -i'. The header of the archive
+// is written right away.
+XPAR_API int xpar_enc_init(xpar_enc ** enc, int interlacing,
+                           xpar_write_fn write, void * opaque);
+// Full laces are encoded straight from `data' when nothing is buffered.
+XPAR_API int xpar_enc_update(xpar_enc * enc, const uint8_t * data, size_t len);
+// Writes the last lace and the trailer.
+XPAR_API int xpar_enc_finish(xpar_enc * enc);
+XPAR_API void xpar_enc_free(xpar_enc * enc);
+
+typedef struct xpar_dec xpar_dec;
+XPAR_API int xpar_dec_init(xpar_dec ** dec, xpar_write_fn write, void * opaque);
+XPAR_API int xpar_dec_update(xpar_dec * dec, const uint8_t * data, size_t len);
+// Checks that the archive is complete and matches its trailer.
+XPAR_API int xpar_dec_finish(xpar_dec * dec);
+// The number of errors corrected so far.
+XPAR_API uint64_t xpar_dec_corrected(const xpar_dec * dec);
+XPAR_API void xpar_dec_free(xpar_dec * dec);
+
+// Buffer calls, for archives held in memory as a whole. They use the given
+// output and scratch memory only and allocate nothing. The sizes of both are
+// found with the `_size' functions; the scratch needed depends only on the
+// interlacing factor, so one scratch buffer serves many calls.
+XPAR_API int xpar_encode_size(size_t len, int interlacing,
+                              size_t * out_size, size_t * scratch);
+// Writes the archive of `len' bytes of `in' to `out', `*written' bytes long.
+XPAR_API int xpar_encode(const uint8_t * in, size_t len, int interlacing,
+                         uint8_t * out, size_t out_size, size_t * written,
+                         void * scratch);
+// Checks the header and the trailer. Without a trailer, `*out_size' is the
+// size of the full laces, an upper bound.
+XPAR_API int xpar_decode_size(const uint8_t * in, size_t len,
+                              size_t * out_size, size_t * scratch);
+// Decodes the archive in `in' to `out'. Bytes of `out' past `*written' may
+// be overwritten. `written' and `corrected' may be NULL.
+XPAR_API int xpar_decode(const uint8_t * in, size_t len, uint8_t * out,
+                         size_t out_size, size_t * written, void * scratch,
+                         uint64_t * corrected);
+// As xpar_decode, but only checks that the archive decodes.
+XPAR_API int xpar_verify(const uint8_t * in, size_t len, void * scratch,
+                         uint64_t * corrected);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif